@@ -1,14 +1,41 @@
 #include <algorithm>
+#include <array>
+#include <asm/perf_regs.h>
+#include <atomic>
+#include <cctype>
+#include <climits>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
 #include <fcntl.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <link.h>
+#include <linux/perf_event.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <regex>
+#include <set>
+#include <signal.h>
 #include <sstream>
+#include <sys/mman.h>
 #include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/user.h>
 #include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "vendor/libelfin/dwarf/dwarf++.hh"
@@ -63,18 +90,19 @@ const std::array<reg_descriptor, n_registers> g_register_descriptors = {{
     { reg::gs, 55, "gs" },
 }};
 
-uint64_t get_register_value(pid_t pid, reg r) {
-    user_regs_struct regs;
-    ptrace(PTRACE_GETREGS, pid, nullptr, &regs);
-
+std::size_t get_register_index(reg r) {
     const reg_descriptor *it =
         std::find_if(begin(g_register_descriptors), end(g_register_descriptors),
                      [r](auto &&rd) { return rd.r == r; });
 
-    return *(reinterpret_cast<uint64_t *>(&regs) + (it - begin(g_register_descriptors)));
+    return it - begin(g_register_descriptors);
+}
+
+uint64_t get_register_value(const user_regs_struct &regs, reg r) {
+    return *(reinterpret_cast<const uint64_t *>(&regs) + get_register_index(r));
 }
 
-uint64_t get_register_value_from_dwarf_register(pid_t pid, int dwarf_r) {
+uint64_t get_register_value_from_dwarf_register(const user_regs_struct &regs, int dwarf_r) {
     const reg_descriptor *it =
         std::find_if(begin(g_register_descriptors), end(g_register_descriptors),
                      [dwarf_r](auto &&rd) { return rd.dwarf_r == dwarf_r; });
@@ -83,7 +111,7 @@ uint64_t get_register_value_from_dwarf_register(pid_t pid, int dwarf_r) {
         throw std::out_of_range("Unknown DWARF register");
     }
 
-    return get_register_value(pid, it->r);
+    return get_register_value(regs, it->r);
 }
 
 std::string get_register_name(reg r) {
@@ -102,16 +130,282 @@ reg get_register_from_name(const std::string name) {
     return it->r;
 }
 
-void set_register_value(pid_t pid, reg r, uint64_t value) {
-    user_regs_struct regs;
-    ptrace(PTRACE_GETREGS, pid, nullptr, &regs);
+void set_register_value(user_regs_struct &regs, reg r, uint64_t value) {
+    *(reinterpret_cast<uint64_t *>(&regs) + get_register_index(r)) = value;
+}
 
-    const reg_descriptor *it =
-        std::find_if(begin(g_register_descriptors), end(g_register_descriptors),
-                     [r](auto &&rd) { return rd.r == r; });
+// Holds the register file of a stopped tracee, so that every stop costs
+// at most one PTRACE_GETREGS and one PTRACE_SETREGS.
+class register_cache {
+public:
+    register_cache(pid_t pid) : m_pid{pid}, m_valid{false}, m_dirty{false}, m_regs{} {}
+
+    const user_regs_struct &get();
+    uint64_t get(reg r);
+    void set(reg r, uint64_t value);
+    void set(const user_regs_struct &regs);
+
+    // Serves a register file captured elsewhere, without writing it back.
+    void load(const user_regs_struct &regs);
+
+    // Must be called before the tracee is resumed.
+    void invalidate();
+
+private:
+    pid_t m_pid;
+    bool m_valid;
+    bool m_dirty;
+    user_regs_struct m_regs;
+};
+
+const user_regs_struct &register_cache::get() {
+    if (!m_valid) {
+        ptrace(PTRACE_GETREGS, m_pid, nullptr, &m_regs);
+        m_valid = true;
+    }
+
+    return m_regs;
+}
+
+uint64_t register_cache::get(reg r) {
+    return get_register_value(get(), r);
+}
+
+void register_cache::set(reg r, uint64_t value) {
+    get();
+    set_register_value(m_regs, r, value);
+    m_dirty = true;
+}
+
+void register_cache::set(const user_regs_struct &regs) {
+    m_regs = regs;
+    m_valid = true;
+    m_dirty = true;
+}
+
+void register_cache::load(const user_regs_struct &regs) {
+    m_regs = regs;
+    m_valid = true;
+    m_dirty = false;
+}
+
+void register_cache::invalidate() {
+    if (m_dirty) {
+        ptrace(PTRACE_SETREGS, m_pid, nullptr, &m_regs);
+        m_dirty = false;
+    }
+
+    m_valid = false;
+}
+
+const std::size_t page_size = 4096;
+
+// Accesses tracee memory in bulk with process_vm_readv, falling back to
+// /proc/<pid>/mem when the former is unavailable. Reads are served from
+// whole cached pages, which must be flushed before the tracee is resumed.
+class tracee_memory {
+public:
+    tracee_memory(pid_t pid) : m_pid{pid}, m_fd{-1}, m_cached{true}, m_hits{0}, m_misses{0} {}
+    tracee_memory(const tracee_memory &) = delete;
+    tracee_memory &operator=(const tracee_memory &) = delete;
+
+    ~tracee_memory() {
+        if (m_fd != -1) {
+            close(m_fd);
+        }
+    }
+
+    void read(uint64_t address, uint8_t *data, std::size_t size);
+    void write(uint64_t address, const uint8_t *data, std::size_t size);
+    void flush();
+
+    // While caching is off, reads go straight to the tracee, for when some
+    // of its threads are running and can change any page.
+    void set_cached(bool cached);
+
+    uint64_t get_hits() const {
+        return m_hits;
+    }
+
+    uint64_t get_misses() const {
+        return m_misses;
+    }
+
+private:
+    using page = std::array<uint8_t, page_size>;
+
+    pid_t m_pid;
+    int m_fd;
+    bool m_cached;
+    std::unordered_map<uint64_t, page> m_pages;
+    uint64_t m_hits;
+    uint64_t m_misses;
+
+    const page *get_page(uint64_t page_address);
+    void read_uncached(uint64_t address, uint8_t *data, std::size_t size);
+    std::size_t read_proc_mem(uint64_t address, uint8_t *data, std::size_t size);
+    int get_proc_mem_fd();
+};
+
+void tracee_memory::read(uint64_t address, uint8_t *data, std::size_t size) {
+    while (size > 0) {
+        uint64_t page_address = address & ~(page_size - 1);
+        std::size_t offset = address - page_address;
+        std::size_t n = std::min(size, page_size - offset);
+
+        const page *p = m_cached ? get_page(page_address) : nullptr;
+
+        if (p) {
+            std::memcpy(data, p->data() + offset, n);
+        } else {
+            read_uncached(address, data, n);
+        }
+
+        address += n;
+        data += n;
+        size -= n;
+    }
+}
+
+// Throws std::runtime_error if any of the range can't be written, in which
+// case part of it may have been.
+void tracee_memory::write(uint64_t address, const uint8_t *data, std::size_t size) {
+    int fd = get_proc_mem_fd();
+
+    if (fd == -1 || pwrite(fd, data, size, address) != static_cast<ssize_t>(size)) {
+        for (std::size_t i = 0; i < size; i += sizeof(long)) {
+            std::size_t n = std::min(sizeof(long), size - i);
+            errno = 0;
+            long word = ptrace(PTRACE_PEEKDATA, m_pid, address + i, nullptr);
+
+            if (errno == 0) {
+                std::memcpy(&word, data + i, n);
+            }
+
+            if (errno != 0 || ptrace(PTRACE_POKEDATA, m_pid, address + i, word) == -1) {
+                for (uint64_t p = address & ~(page_size - 1); p < address + size; p += page_size) {
+                    m_pages.erase(p);
+                }
+
+                std::stringstream message;
+                message << "Cannot write memory at address 0x" << std::hex << address + i;
+                throw std::runtime_error(message.str());
+            }
+        }
+    }
+
+    for (std::size_t i = 0; i < size; i++) {
+        uint64_t page_address = (address + i) & ~(page_size - 1);
+        auto it = m_pages.find(page_address);
+
+        if (it != m_pages.end()) {
+            it->second[address + i - page_address] = data[i];
+        }
+    }
+}
+
+void tracee_memory::flush() {
+    m_pages.clear();
+}
+
+void tracee_memory::set_cached(bool cached) {
+    m_cached = cached;
+
+    if (!cached) {
+        flush();
+    }
+}
+
+const tracee_memory::page *tracee_memory::get_page(uint64_t page_address) {
+    auto it = m_pages.find(page_address);
+
+    if (it != m_pages.end()) {
+        m_hits++;
+        return &it->second;
+    }
+
+    m_misses++;
+
+    page p;
+
+    try {
+        read_uncached(page_address, p.data(), p.size());
+    } catch (std::runtime_error &) {
+        return nullptr;
+    }
+
+    return &m_pages.emplace(page_address, p).first->second;
+}
+
+void tracee_memory::read_uncached(uint64_t address, uint8_t *data, std::size_t size) {
+    std::size_t done = 0;
+
+    while (done < size) {
+        iovec local {data + done, size - done};
+        iovec remote {reinterpret_cast<void *>(address + done), size - done};
+        ssize_t n = process_vm_readv(m_pid, &local, 1, &remote, 1, 0);
+
+        if (n <= 0) {
+            n = read_proc_mem(address + done, data + done, size - done);
+        }
+
+        if (n <= 0) {
+            std::stringstream message;
+            message << "Cannot read memory at address 0x" << std::hex << address + done;
+            throw std::runtime_error(message.str());
+        }
+
+        done += n;
+    }
+}
+
+std::size_t tracee_memory::read_proc_mem(uint64_t address, uint8_t *data, std::size_t size) {
+    int fd = get_proc_mem_fd();
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    ssize_t n = pread(fd, data, size, address);
+    return n < 0 ? 0 : n;
+}
+
+int tracee_memory::get_proc_mem_fd() {
+    if (m_fd == -1) {
+        std::string path = "/proc/" + std::to_string(m_pid) + "/mem";
+        m_fd = open(path.c_str(), O_RDWR);
+    }
+
+    return m_fd;
+}
+
+std::vector<std::string> split(const std::string &str, char delimiter) {
+    std::vector<std::string> out {};
+    std::stringstream stream {str};
+    std::string item;
+
+    while (std::getline(stream, item, delimiter)) {
+        out.push_back(item);
+    }
+
+    return out;
+}
+
+bool is_prefix(const std::string &str, const std::string &of) {
+    if (str.size() > of.size()) {
+        return false;
+    }
+
+    return std::equal(str.begin(), str.end(), of.begin());
+}
+
+bool is_suffix(const std::string &str, const std::string &of) {
+    if (str.size() > of.size()) {
+        return false;
+    }
 
-    *(reinterpret_cast<uint64_t *>(&regs) + (it - begin(g_register_descriptors))) = value;
-    ptrace(PTRACE_SETREGS, pid, nullptr, &regs);
+    unsigned long diff = of.size() - str.size();
+    return std::equal(str.begin(), str.end(), of.begin() + diff);
 }
 
 enum class symbol_type {
@@ -174,603 +468,6967 @@ struct symbol {
 
 class ptrace_expr_context : public dwarf::expr_context {
     public:
-        ptrace_expr_context(pid_t pid) : m_pid{pid} {}
+        ptrace_expr_context(register_cache &registers, tracee_memory &memory)
+            : m_registers{registers}, m_memory{memory} {}
 
         dwarf::taddr reg(unsigned regnum) override {
-            return get_register_value_from_dwarf_register(m_pid, regnum);
+            return get_register_value_from_dwarf_register(m_registers.get(), regnum);
         }
 
         dwarf::taddr pc() override {
-            struct user_regs_struct regs;
-            ptrace(PTRACE_GETREGS, m_pid, nullptr, &regs);
-            return regs.rip;
+            return m_registers.get(reg::rip);
         }
 
         dwarf::taddr deref_size(dwarf::taddr address, unsigned size) override {
-            return ptrace(PTRACE_PEEKDATA, m_pid, address, nullptr);
+            dwarf::taddr value = 0;
+            m_memory.read(address, reinterpret_cast<uint8_t *>(&value),
+                          std::min<std::size_t>(size, sizeof(value)));
+            return value;
         }
 
     private:
-        pid_t m_pid;
+        register_cache &m_registers;
+        tracee_memory &m_memory;
 };
 
-class breakpoint {
-public:
-    breakpoint(pid_t pid, std::intptr_t address)
-        : m_pid{pid}, m_address{address}, m_enabled{false}, m_data{} {}
+enum class branch_kind {
+    none,
+    call,
+    jump,
+    conditional_jump,
+    indirect_call,
+    // Branches whose target is only known when they run.
+    indirect_jump,
+    ret,
+};
 
-    void enable();
-    void disable();
+const std::size_t max_instruction_size = 15;
+
+// The parts of a decoded x86-64 instruction needed to execute it at
+// another address.
+struct x86_instruction {
+    std::size_t length;
+    branch_kind branch;
+    // Offset and size of a relative branch displacement, if any.
+    std::size_t rel_offset;
+    std::size_t rel_size;
+    // Offset of a RIP-relative memory displacement, or 0 if there is none.
+    std::size_t rip_disp_offset;
+};
 
-    bool is_enabled() const {
-        return m_enabled;
+// Decodes the length and the position dependent parts of one instruction.
+// Throws std::invalid_argument for encodings it does not understand.
+x86_instruction decode_instruction(const uint8_t *code, std::size_t size) {
+    x86_instruction ins {0, branch_kind::none, 0, 0, 0};
+    std::size_t pos = 0;
+    bool operand_size = false;
+    bool address_size = false;
+    bool rex_w = false;
+
+    auto next = [&]() -> uint8_t {
+        if (pos >= size) {
+            throw std::invalid_argument("Truncated instruction");
+        }
+
+        return code[pos++];
+    };
+
+    uint8_t op = next();
+
+    // Legacy prefixes.
+    while (op == 0xF0 || op == 0xF2 || op == 0xF3 || op == 0x2E || op == 0x36 || op == 0x3E ||
+           op == 0x26 || op == 0x64 || op == 0x65 || op == 0x66 || op == 0x67) {
+        operand_size |= op == 0x66;
+        address_size |= op == 0x67;
+        op = next();
     }
 
-    std::intptr_t get_address() const {
-        return m_address;
+    if ((op & 0xF0) == 0x40) {
+        rex_w = op & 0x08;
+        op = next();
     }
 
-private:
-    pid_t m_pid;
-    std::intptr_t m_address;
-    bool m_enabled;
-    uint8_t m_data;
-};
+    // Opcode map: 0 is the one-byte map, 1 is 0F, 2 is 0F 38 and 3 is 0F 3A.
+    int map = 0;
+
+    if (op == 0xC5) {
+        next();
+        map = 1;
+        op = next();
+    } else if (op == 0xC4) {
+        map = next() & 0x1F;
+        rex_w = next() & 0x80;
+        op = next();
+    } else if (op == 0x62) {
+        throw std::invalid_argument("EVEX instructions are not supported");
+    } else if (op == 0x0F) {
+        map = 1;
+        op = next();
+
+        if (op == 0x38 || op == 0x3A) {
+            map = op == 0x38 ? 2 : 3;
+            op = next();
+        }
+    }
 
-void breakpoint::enable() {
-    long data = ptrace(PTRACE_PEEKDATA, m_pid, m_address, nullptr);
-    m_data = static_cast<uint8_t>(data & 0xFF);
-    uint64_t new_data = (data & ~0xFF) | 0xCC;
-    ptrace(PTRACE_POKEDATA, m_pid, m_address, new_data);
+    std::size_t imm_size = 0;
+    std::size_t imm32 = operand_size ? 2 : 4;
+    bool has_modrm = true;
+
+    if (map == 0) {
+        uint8_t row = op >> 4;
+        uint8_t col = op & 0x0F;
+        has_modrm = false;
+
+        if (row <= 3 && (col & 0x07) <= 3) {
+            has_modrm = true;
+        } else if (row <= 3 && (col & 0x07) == 4) {
+            imm_size = 1;
+        } else if (row <= 3 && (col & 0x07) == 5) {
+            imm_size = imm32;
+        } else if (op == 0x63 || (op >= 0x84 && op <= 0x8F) || (op >= 0xD0 && op <= 0xD3) ||
+                   (op >= 0xD8 && op <= 0xDF) || op == 0xF6 || op == 0xF7 || op == 0xFE ||
+                   op == 0xFF) {
+            has_modrm = true;
+        } else if (op == 0x69 || op == 0x81 || op == 0xC7) {
+            has_modrm = true;
+            imm_size = imm32;
+        } else if (op == 0x6B || op == 0x80 || op == 0x83 || op == 0xC0 || op == 0xC1 ||
+                   op == 0xC6) {
+            has_modrm = true;
+            imm_size = 1;
+        } else if (op == 0x68 || op == 0xA9) {
+            imm_size = imm32;
+        } else if (op == 0x6A || op == 0xA8 || (op >= 0xB0 && op <= 0xB7) || op == 0xCD ||
+                   (op >= 0xE4 && op <= 0xE7)) {
+            imm_size = 1;
+        } else if (op >= 0xB8 && op <= 0xBF) {
+            imm_size = rex_w ? 8 : imm32;
+        } else if (op >= 0xA0 && op <= 0xA3) {
+            imm_size = address_size ? 4 : 8;
+        } else if (op == 0xC2 || op == 0xCA) {
+            ins.branch = branch_kind::ret;
+            imm_size = 2;
+        } else if (op == 0xC3 || op == 0xCB || op == 0xCF) {
+            ins.branch = branch_kind::ret;
+        } else if (op == 0xC8) {
+            imm_size = 3;
+        } else if ((op >= 0x70 && op <= 0x7F) || (op >= 0xE0 && op <= 0xE3)) {
+            ins.branch = branch_kind::conditional_jump;
+            ins.rel_size = 1;
+        } else if (op == 0xEB) {
+            ins.branch = branch_kind::jump;
+            ins.rel_size = 1;
+        } else if (op == 0xE8 || op == 0xE9) {
+            ins.branch = op == 0xE8 ? branch_kind::call : branch_kind::jump;
+            ins.rel_size = 4;
+        } else if (op == 0x9A || op == 0xEA || op == 0xD4 || op == 0xD5 || op == 0x06 ||
+                   op == 0x07 || op == 0x0E || op == 0x16 || op == 0x17 || op == 0x1E ||
+                   op == 0x1F || op == 0x27 || op == 0x2F || op == 0x37 || op == 0x3F ||
+                   op == 0x60 || op == 0x61 || op == 0xCE) {
+            throw std::invalid_argument("Invalid instruction in 64-bit mode");
+        }
+    } else if (map == 1) {
+        if (op >= 0x80 && op <= 0x8F) {
+            has_modrm = false;
+            ins.branch = branch_kind::conditional_jump;
+            ins.rel_size = 4;
+        } else if (op == 0x05 || op == 0x06 || op == 0x07 || op == 0x08 || op == 0x09 ||
+                   op == 0x0B || op == 0x0E || (op >= 0x30 && op <= 0x37) || op == 0x77 ||
+                   op == 0xA0 || op == 0xA1 || op == 0xA2 || op == 0xA8 || op == 0xA9 ||
+                   op == 0xAA || (op >= 0xC8 && op <= 0xCF)) {
+            has_modrm = false;
+        } else if ((op >= 0x70 && op <= 0x73) || op == 0xA4 || op == 0xAC || op == 0xBA ||
+                   op == 0xC2 || (op >= 0xC4 && op <= 0xC6)) {
+            imm_size = 1;
+        }
+    } else if (map == 3) {
+        imm_size = 1;
+    } else if (map != 2) {
+        throw std::invalid_argument("Unknown opcode map");
+    }
 
-    m_enabled = true;
-}
+    if (has_modrm) {
+        uint8_t modrm = next();
+        uint8_t mod = modrm >> 6;
+        uint8_t rm = modrm & 0x07;
+        std::size_t disp_size = 0;
 
-void breakpoint::disable() {
-    long data = ptrace(PTRACE_PEEKDATA, m_pid, m_address, nullptr);
-    long new_data = (data & ~0xFF) | m_data;
-    ptrace(PTRACE_POKEDATA, m_pid, m_address, new_data);
+        // F6 and F7 only take an immediate in their TEST forms.
+        if (map == 0 && (op == 0xF6 || op == 0xF7) && ((modrm >> 3) & 0x07) <= 1) {
+            imm_size = op == 0xF6 ? 1 : imm32;
+        }
 
-    m_enabled = false;
-}
+        if (map == 0 && op == 0xFF && ((modrm >> 3) & 0x07) == 2) {
+            ins.branch = branch_kind::indirect_call;
+        } else if (map == 0 && op == 0xFF && ((modrm >> 3) & 0x07) >= 3 &&
+                   ((modrm >> 3) & 0x07) <= 5) {
+            ins.branch = branch_kind::indirect_jump;
+        }
 
-class debugger {
-public:
-    debugger(std::string prog_name, pid_t pid)
-        : m_prog_name{std::move(prog_name)}, m_pid{pid} {
-        int fd = open(m_prog_name.c_str(), O_RDONLY);
+        if (mod != 3) {
+            if (rm == 4) {
+                uint8_t sib = next();
 
-        m_elf = elf::elf {elf::create_mmap_loader(fd)};
-        m_dwarf = dwarf::dwarf {dwarf::elf::create_loader(m_elf)};
-    }
+                if (mod == 0 && (sib & 0x07) == 5) {
+                    disp_size = 4;
+                }
+            } else if (mod == 0 && rm == 5) {
+                ins.rip_disp_offset = pos;
+                disp_size = 4;
+            }
 
-    void run();
+            if (mod == 1) {
+                disp_size = 1;
+            } else if (mod == 2) {
+                disp_size = 4;
+            }
+        }
 
-private:
-    std::string m_prog_name;
-    pid_t m_pid;
-    std::unordered_map<std::intptr_t, breakpoint> m_breakpoints;
-    elf::elf m_elf;
-    dwarf::dwarf m_dwarf;
+        pos += disp_size;
+    }
 
-    void handle_command(const std::string &line);
-    void continue_execution();
-    void set_breakpoint_at_address(std::intptr_t address);
-    void set_breakpoint_at_function(const std::string &name);
-    void set_breakpoint_at_line(const std::string &file, unsigned line);
-    void remove_breakpoint(std::intptr_t address);
-    void dump_registers();
-    uint64_t read_memory(uint64_t address);
-    void write_memory(uint64_t address, uint64_t value);
-    uint64_t get_pc();
-    void set_pc(uint64_t pc);
-    void step_single_instruction();
-    void step_single_instruction_with_breakpoint_check();
-    void step_over_breakpoint();
-    void step_in();
-    void step_over();
-    void step_out();
-    void wait_for_signal();
-    dwarf::die get_function_from_pc(uint64_t pc);
-    dwarf::line_table::iterator get_line_entry_from_pc(uint64_t pc);
-    void print_source(const std::string &filename, unsigned line, unsigned n_lines_context = 2);
-    void print_backtrace();
-    siginfo_t get_signal_info();
-    void handle_sigtrap(siginfo_t info);
-    std::vector<symbol> lookup_symbol(const std::string &name);
-    void read_variables();
-};
+    if (ins.rel_size) {
+        ins.rel_offset = pos;
+        pos += ins.rel_size;
+    }
 
-void debugger::run() {
-    wait_for_signal();
+    pos += imm_size;
 
-    char *line = nullptr;
-    while ((line = linenoise("dbg> ")) != nullptr) {
-        handle_command(line);
-        linenoiseHistoryAdd(line);
-        linenoiseFree(line);
+    if (pos > size) {
+        throw std::invalid_argument("Truncated instruction");
     }
+
+    ins.length = pos;
+    return ins;
 }
 
-std::vector<std::string> split(const std::string &str, char delimiter) {
-    std::vector<std::string> out {};
-    std::stringstream stream {str};
-    std::string item;
+// Returns the target of a relative branch decoded from code, which is
+// at address in the tracee.
+uint64_t get_branch_target(const uint8_t *code, const x86_instruction &ins, uint64_t address) {
+    int64_t rel;
 
-    while (std::getline(stream, item, delimiter)) {
-        out.push_back(item);
+    if (ins.rel_size == 1) {
+        rel = static_cast<int8_t>(code[ins.rel_offset]);
+    } else {
+        int32_t rel32;
+        std::memcpy(&rel32, code + ins.rel_offset, sizeof(rel32));
+        rel = rel32;
     }
 
-    return out;
+    return address + ins.length + rel;
 }
 
-bool is_prefix(const std::string &str, const std::string &of) {
-    if (str.size() > of.size()) {
-        return false;
+// Copies instructions to another address, adjusting their RIP-relative
+// operands so that they still refer to the same data.
+std::vector<uint8_t> relocate_instructions(const uint8_t *code, std::size_t size, uint64_t from,
+                                           uint64_t to) {
+    std::vector<uint8_t> relocated {code, code + size};
+    std::size_t pos = 0;
+
+    while (pos < size) {
+        x86_instruction ins = decode_instruction(code + pos, size - pos);
+
+        if (ins.rel_size) {
+            throw std::invalid_argument("Cannot relocate a relative branch");
+        }
+
+        if (ins.rip_disp_offset) {
+            int32_t disp;
+            std::memcpy(&disp, code + pos + ins.rip_disp_offset, sizeof(disp));
+
+            int64_t target = from + pos + ins.length + disp;
+            int64_t new_disp = target - static_cast<int64_t>(to + pos + ins.length);
+
+            if (new_disp != static_cast<int32_t>(new_disp)) {
+                throw std::invalid_argument("Relocated operand is out of range");
+            }
+
+            disp = new_disp;
+            std::memcpy(relocated.data() + pos + ins.rip_disp_offset, &disp, sizeof(disp));
+        }
+
+        pos += ins.length;
     }
 
-    return std::equal(str.begin(), str.end(), of.begin());
+    return relocated;
 }
 
-bool is_suffix(const std::string &str, const std::string &of) {
-    if (str.size() > of.size()) {
-        return false;
+// Appends a jmp rel32 at address from to address to.
+void emit_jump(std::vector<uint8_t> &code, uint64_t from, uint64_t to) {
+    int64_t rel = static_cast<int64_t>(to) - static_cast<int64_t>(from + 5);
+
+    if (rel != static_cast<int32_t>(rel)) {
+        throw std::invalid_argument("Jump target is out of range");
     }
 
-    unsigned long diff = of.size() - str.size();
-    return std::equal(str.begin(), str.end(), of.begin() + diff);
+    int32_t rel32 = rel;
+    code.push_back(0xE9);
+    code.insert(code.end(), reinterpret_cast<uint8_t *>(&rel32),
+                reinterpret_cast<uint8_t *>(&rel32) + sizeof(rel32));
 }
 
-void debugger::handle_command(const std::string &line) {
-    std::vector<std::string> args = split(line, ' ');
-    std::string command = args[0];
+// A record written by a fast tracepoint into the trace ring.
+struct trace_record {
+    uint64_t sequence;
+    uint64_t timestamp;
+    uint64_t reserved[2];
+    user_regs_struct regs;
+};
 
-    if (is_prefix(command, "continue")) {
-        continue_execution();
-    } else if (is_prefix(command, "breakpoint")) {
-        if (args[1][0] == '0' && args[1][1] == 'x') {
-            std::string str {args[1], 2};
-            uint64_t address = std::stol(str, nullptr, 16);
-            set_breakpoint_at_address(address);
-        } else if (args[1].find(':') != std::string::npos) {
-            std::vector<std::string> file_and_line = split(args[1], ':');
-            set_breakpoint_at_line(file_and_line[0], stoi(file_and_line[1]));
-        } else {
-            set_breakpoint_at_function(args[1]);
-        }
-    } else if (is_prefix(command, "register")) {
-        if (is_prefix(args[1], "dump")) {
-            dump_registers();
-        } else if (is_prefix(args[1], "read")) {
-            reg reg = get_register_from_name(args[2]);
-            std::cout << get_register_value(m_pid, reg) << std::endl;
+const std::size_t trace_record_size = 256;
+const std::size_t trace_ring_header_size = 64;
+const std::size_t n_trace_ring_records = 1 << 14;
+
+static_assert(sizeof(trace_record) <= trace_record_size, "Trace records must fit their slots");
+
+// A ring buffer of trace records in shared memory, written by trampolines
+// in the tracee and drained by a background thread in the debugger. The
+// first word of the header is the number of reserved records, and the
+// second is the index mask. A record is complete once its sequence number
+// is one past its index.
+class trace_ring {
+public:
+    trace_ring(pid_t pid);
+    trace_ring(const trace_ring &) = delete;
+    trace_ring &operator=(const trace_ring &) = delete;
+    ~trace_ring();
+
+    // The shared memory file, which is unlinked once the tracee maps it.
+    const std::string &get_path() const {
+        return m_path;
+    }
+
+    std::size_t get_size() const {
+        return m_size;
+    }
+
+    void unlink_path();
+    std::vector<trace_record> take();
+
+    uint64_t get_dropped() const {
+        return m_dropped;
+    }
+
+private:
+    std::string m_path;
+    std::size_t m_size;
+    uint8_t *m_data;
+    uint64_t m_tail;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<bool> m_stopping;
+    std::mutex m_mutex;
+    std::vector<trace_record> m_records;
+    std::thread m_drainer;
+
+    void drain();
+};
+
+trace_ring::trace_ring(pid_t pid)
+    : m_size{trace_ring_header_size + n_trace_ring_records * trace_record_size}, m_data{nullptr},
+      m_tail{0}, m_dropped{0}, m_stopping{false} {
+    m_path = "/dev/shm/dbg-trace-" + std::to_string(getpid()) + "-" + std::to_string(pid);
+
+    // A file left behind by an earlier debugger that had the same pids is
+    // stale.
+    unlink(m_path.c_str());
+    int fd = open(m_path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    if (fd == -1) {
+        throw std::runtime_error("Cannot create " + m_path);
+    }
+
+    if (ftruncate(fd, m_size) == -1) {
+        close(fd);
+        unlink_path();
+        throw std::runtime_error("Cannot resize " + m_path);
+    }
+
+    void *data = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        unlink_path();
+        throw std::runtime_error("Cannot map " + m_path);
+    }
+
+    m_data = static_cast<uint8_t *>(data);
+    reinterpret_cast<uint64_t *>(m_data)[1] = n_trace_ring_records - 1;
+    m_drainer = std::thread {&trace_ring::drain, this};
+}
+
+trace_ring::~trace_ring() {
+    m_stopping = true;
+    m_drainer.join();
+    munmap(m_data, m_size);
+    unlink_path();
+}
+
+void trace_ring::unlink_path() {
+    if (!m_path.empty()) {
+        unlink(m_path.c_str());
+        m_path.clear();
+    }
+}
+
+std::vector<trace_record> trace_ring::take() {
+    std::lock_guard<std::mutex> lock {m_mutex};
+    std::vector<trace_record> records;
+    records.swap(m_records);
+    return records;
+}
+
+void trace_ring::drain() {
+    uint64_t *head = reinterpret_cast<uint64_t *>(m_data);
+    const uint8_t *slots = m_data + trace_ring_header_size;
+    std::vector<trace_record> batch;
+
+    while (!m_stopping) {
+        uint64_t end = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+
+        if (end - m_tail > n_trace_ring_records) {
+            m_dropped += end - m_tail - n_trace_ring_records;
+            m_tail = end - n_trace_ring_records;
+        }
+
+        while (m_tail < end) {
+            const trace_record *slot = reinterpret_cast<const trace_record *>(
+                slots + (m_tail & (n_trace_ring_records - 1)) * trace_record_size);
+            uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+            // Not written yet; try again on the next pass.
+            if (sequence <= m_tail) {
+                break;
+            }
+
+            trace_record record = *slot;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            // Overwritten by a writer that lapped the ring, during or
+            // before the copy.
+            if (sequence != m_tail + 1 ||
+                __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) {
+                m_dropped++;
+                m_tail++;
+                continue;
+            }
+
+            batch.push_back(record);
+            m_tail++;
+        }
+
+        if (!batch.empty()) {
+            std::lock_guard<std::mutex> lock {m_mutex};
+            m_records.insert(m_records.end(), batch.begin(), batch.end());
+            batch.clear();
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+// Builds a trampoline that appends a trace record with the register file
+// to the ring, runs the instructions displaced from the site, and jumps
+// back after them.
+std::vector<uint8_t> build_trace_trampoline(uint64_t address, uint64_t site,
+                                            const std::vector<uint8_t> &displaced,
+                                            uint64_t ring) {
+    std::vector<uint8_t> code;
+
+    auto emit = [&code](std::initializer_list<uint8_t> bytes) {
+        code.insert(code.end(), bytes);
+    };
+
+    auto emit_value = [&code](auto value) {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value);
+        code.insert(code.end(), bytes, bytes + sizeof(value));
+    };
+
+    auto register_offset = [](reg r) {
+        return static_cast<int32_t>(offsetof(trace_record, regs) +
+                                    get_register_index(r) * sizeof(uint64_t));
+    };
+
+    // mov [rdi + offset], <hardware register>
+    auto store = [&](int hw, int32_t offset) {
+        emit({static_cast<uint8_t>(hw >= 8 ? 0x4C : 0x48), 0x89,
+              static_cast<uint8_t>(0x80 | (hw & 7) << 3 | 7)});
+        emit_value(offset);
+    };
+
+    // mov rax, [rsp + offset]
+    auto load_saved = [&](int32_t offset) {
+        emit({0x48, 0x8B, 0x84, 0x24});
+        emit_value(offset);
+    };
+
+    emit({0x48, 0x8D, 0x64, 0x24, 0x80}); // lea rsp, [rsp - 128] (skip the red zone)
+    emit({0x9C});                         // pushfq
+    emit({0x50, 0x51, 0x52, 0x56, 0x57}); // push rax, rcx, rdx, rsi, rdi
+    emit({0x41, 0x50, 0x41, 0x51, 0x41, 0x52, 0x41, 0x53}); // push r8, r9, r10, r11
+
+    emit({0x48, 0xBF}); // movabs rdi, ring
+    emit_value(ring);
+    emit({0xB8, 0x01, 0x00, 0x00, 0x00});       // mov eax, 1
+    emit({0xF0, 0x48, 0x0F, 0xC1, 0x07});       // lock xadd [rdi], rax
+    emit({0x48, 0x89, 0xC6});                   // mov rsi, rax
+    emit({0x48, 0x23, 0x47, 0x08});             // and rax, [rdi + 8]
+    emit({0x48, 0xC1, 0xE0, 0x08});             // shl rax, 8
+    emit({0x48, 0x8D, 0x7C, 0x07, static_cast<uint8_t>(trace_ring_header_size)});
+                                                // lea rdi, [rdi + rax + header]
+
+    // Registers that are still live.
+    store(15, register_offset(reg::r15));
+    store(14, register_offset(reg::r14));
+    store(13, register_offset(reg::r13));
+    store(12, register_offset(reg::r12));
+    store(5, register_offset(reg::rbp));
+    store(3, register_offset(reg::rbx));
+
+    // Registers saved on the stack, from the last one pushed.
+    const std::array<reg, 10> saved = {{
+        reg::r11, reg::r10, reg::r9, reg::r8, reg::rdi,
+        reg::rsi, reg::rdx, reg::rcx, reg::rax, reg::rflags,
+    }};
+
+    for (std::size_t i = 0; i < saved.size(); i++) {
+        load_saved(i * sizeof(uint64_t));
+        store(0, register_offset(saved[i]));
+    }
+
+    emit({0x48, 0x8D, 0x84, 0x24}); // lea rax, [rsp + saved + red zone]
+    emit_value(static_cast<int32_t>(saved.size() * sizeof(uint64_t) + 128));
+    store(0, register_offset(reg::rsp));
+
+    emit({0x48, 0xB8}); // movabs rax, site
+    emit_value(site);
+    store(0, register_offset(reg::rip));
+
+    emit({0x0F, 0x31});             // rdtsc
+    emit({0x48, 0xC1, 0xE2, 0x20}); // shl rdx, 32
+    emit({0x48, 0x09, 0xD0});       // or rax, rdx
+    store(0, offsetof(trace_record, timestamp));
+
+    emit({0x48, 0x8D, 0x46, 0x01}); // lea rax, [rsi + 1]
+    emit({0x48, 0x89, 0x07});       // mov [rdi], rax (publish the record)
+
+    emit({0x41, 0x5B, 0x41, 0x5A, 0x41, 0x59, 0x41, 0x58}); // pop r11, r10, r9, r8
+    emit({0x5F, 0x5E, 0x5A, 0x59, 0x58});                   // pop rdi, rsi, rdx, rcx, rax
+    emit({0x9D});                                           // popfq
+    emit({0x48, 0x8D, 0xA4, 0x24, 0x80, 0x00, 0x00, 0x00}); // lea rsp, [rsp + 128]
+
+    std::vector<uint8_t> relocated = relocate_instructions(
+        displaced.data(), displaced.size(), site, address + code.size());
+    code.insert(code.end(), relocated.begin(), relocated.end());
+    emit_jump(code, address + code.size(), site + displaced.size());
+
+    return code;
+}
+
+// Whether a location expression is a fixed address in the file, which
+// has to be moved by the load bias to find the variable at runtime.
+bool is_static_location(const dwarf::value &location) {
+    const uint8_t dw_op_addr = 0x03;
+    std::size_t size;
+    const uint8_t *expr = static_cast<const uint8_t *>(location.as_block(&size));
+    return size > 0 && expr[0] == dw_op_addr;
+}
+
+// Whether a location expression names a register holding the variable.
+bool is_register_location(const dwarf::value &location) {
+    const uint8_t dw_op_reg0 = 0x50;
+    const uint8_t dw_op_reg31 = 0x6f;
+    const uint8_t dw_op_regx = 0x90;
+    std::size_t size;
+    const uint8_t *expr = static_cast<const uint8_t *>(location.as_block(&size));
+    return (size == 1 && expr[0] >= dw_op_reg0 && expr[0] <= dw_op_reg31) ||
+           (size > 1 && expr[0] == dw_op_regx);
+}
+
+// An expression evaluated when a breakpoint is hit, such as its condition,
+// parsed once into bytecode for a stack machine. Variables are resolved
+// against the function of the breakpoint when the expression is compiled,
+// and read through the register and page caches when it is evaluated.
+class breakpoint_expression {
+public:
+    // Static variables are moved by bias, the load bias of the module
+    // holding func.
+    breakpoint_expression(const std::string &text, const dwarf::die &func, uint64_t bias);
+
+    int64_t evaluate(register_cache &registers, tracee_memory &memory) const;
+
+    const std::string &get_text() const {
+        return m_text;
+    }
+
+    // Whether evaluating the expression reads the tracee's memory, rather
+    // than only its registers.
+    bool reads_memory() const {
+        return m_reads_memory;
+    }
+
+private:
+    enum class opcode : uint8_t {
+        constant, variable, reg, deref,
+        negate, logical_not, bit_not,
+        mul, div, mod, add, sub, shl, shr,
+        lt, le, gt, ge, eq, ne,
+        bit_and, bit_xor, bit_or, logical_and, logical_or,
+    };
+
+    struct instruction {
+        opcode op;
+        uint64_t operand;
+    };
+
+    struct variable {
+        dwarf::expr location;
+        // Added to the address the location evaluates to.
+        uint64_t bias;
+        std::size_t size;
+        bool is_signed;
+    };
+
+    std::string m_text;
+    std::vector<instruction> m_code;
+    std::vector<variable> m_variables;
+    uint64_t m_bias;
+    bool m_reads_memory;
+
+    // Parser state, only used while compiling.
+    std::size_t m_pos;
+
+    void skip_spaces();
+    bool accept(const std::string &token);
+    void parse_binary(int precedence, const dwarf::die &func);
+    void parse_unary(const dwarf::die &func);
+    void parse_primary(const dwarf::die &func);
+    void add_variable(const std::string &name, const dwarf::die &func);
+};
+
+breakpoint_expression::breakpoint_expression(const std::string &text, const dwarf::die &func,
+                                             uint64_t bias)
+    : m_text{text}, m_bias{bias}, m_reads_memory{false}, m_pos{0} {
+    parse_binary(0, func);
+    skip_spaces();
+
+    if (m_pos != m_text.size()) {
+        throw std::invalid_argument("Unexpected '" + m_text.substr(m_pos) + "' in expression");
+    }
+}
+
+void breakpoint_expression::skip_spaces() {
+    while (m_pos < m_text.size() && std::isspace(static_cast<unsigned char>(m_text[m_pos]))) {
+        m_pos++;
+    }
+}
+
+bool breakpoint_expression::accept(const std::string &token) {
+    skip_spaces();
+
+    if (m_text.compare(m_pos, token.size(), token) != 0) {
+        return false;
+    }
+
+    m_pos += token.size();
+    return true;
+}
+
+void breakpoint_expression::parse_binary(int precedence, const dwarf::die &func) {
+    // Operators from the loosest to the tightest binding, longest first
+    // within a level so that "<=" is not read as "<".
+    static const std::vector<std::vector<std::pair<std::string, opcode>>> levels = {
+        {{"||", opcode::logical_or}},
+        {{"&&", opcode::logical_and}},
+        {{"|", opcode::bit_or}},
+        {{"^", opcode::bit_xor}},
+        {{"&", opcode::bit_and}},
+        {{"==", opcode::eq}, {"!=", opcode::ne}},
+        {{"<=", opcode::le}, {">=", opcode::ge}, {"<", opcode::lt}, {">", opcode::gt}},
+        {{"<<", opcode::shl}, {">>", opcode::shr}},
+        {{"+", opcode::add}, {"-", opcode::sub}},
+        {{"*", opcode::mul}, {"/", opcode::div}, {"%", opcode::mod}},
+    };
+
+    if (precedence == static_cast<int>(levels.size())) {
+        parse_unary(func);
+        return;
+    }
+
+    parse_binary(precedence + 1, func);
+
+    for (;;) {
+        bool found = false;
+
+        for (const auto &op : levels[precedence]) {
+            std::size_t pos = m_pos;
+
+            if (!accept(op.first)) {
+                continue;
+            }
+
+            // Do not read "&&" as "&", or "<<" as "<".
+            if (op.first.size() == 1 && m_pos < m_text.size() && m_text[m_pos] == op.first[0]) {
+                m_pos = pos;
+                continue;
+            }
+
+            parse_binary(precedence + 1, func);
+            m_code.push_back(instruction {op.second, 0});
+            found = true;
+            break;
+        }
+
+        if (!found) {
+            return;
+        }
+    }
+}
+
+void breakpoint_expression::parse_unary(const dwarf::die &func) {
+    if (accept("-")) {
+        parse_unary(func);
+        m_code.push_back(instruction {opcode::negate, 0});
+    } else if (accept("!")) {
+        parse_unary(func);
+        m_code.push_back(instruction {opcode::logical_not, 0});
+    } else if (accept("~")) {
+        parse_unary(func);
+        m_code.push_back(instruction {opcode::bit_not, 0});
+    } else if (accept("*")) {
+        parse_unary(func);
+        m_code.push_back(instruction {opcode::deref, 0});
+        m_reads_memory = true;
+    } else {
+        parse_primary(func);
+    }
+}
+
+void breakpoint_expression::parse_primary(const dwarf::die &func) {
+    skip_spaces();
+
+    if (accept("(")) {
+        parse_binary(0, func);
+
+        if (!accept(")")) {
+            throw std::invalid_argument("Expected ')' in expression");
+        }
+
+        return;
+    }
+
+    std::size_t start = m_pos;
+
+    if (m_pos < m_text.size() && std::isdigit(static_cast<unsigned char>(m_text[m_pos]))) {
+        std::size_t length;
+        uint64_t value = std::stoull(m_text.substr(m_pos), &length, 0);
+        m_pos += length;
+        m_code.push_back(instruction {opcode::constant, value});
+        return;
+    }
+
+    bool is_register = accept("$");
+    start = m_pos;
+
+    while (m_pos < m_text.size() &&
+           (std::isalnum(static_cast<unsigned char>(m_text[m_pos])) || m_text[m_pos] == '_')) {
+        m_pos++;
+    }
+
+    std::string name = m_text.substr(start, m_pos - start);
+
+    if (name.empty()) {
+        throw std::invalid_argument("Expected a value in expression");
+    }
+
+    if (is_register) {
+        auto it = std::find_if(begin(g_register_descriptors), end(g_register_descriptors),
+                               [&name](auto &&rd) { return rd.name == name; });
+
+        if (it == end(g_register_descriptors)) {
+            throw std::invalid_argument("Unknown register $" + name);
+        }
+
+        m_code.push_back(instruction {opcode::reg, static_cast<uint64_t>(it->r)});
+    } else {
+        add_variable(name, func);
+    }
+}
+
+void breakpoint_expression::add_variable(const std::string &name, const dwarf::die &func) {
+    for (const dwarf::die &die : func) {
+        if (die.tag != dwarf::DW_TAG::variable && die.tag != dwarf::DW_TAG::formal_parameter) {
+            continue;
+        }
+
+        if (!die.has(dwarf::DW_AT::name) || at_name(die) != name) {
+            continue;
+        }
+
+        dwarf::value loc_val = die[dwarf::DW_AT::location];
+
+        if (loc_val.get_type() != dwarf::value::type::exprloc) {
+            throw std::invalid_argument("Variable " + name + " has no fixed location");
+        }
+
+        variable var {loc_val.as_exprloc(), is_static_location(loc_val) ? m_bias : 0,
+                      sizeof(uint64_t), false};
+
+        if (!is_register_location(loc_val)) {
+            m_reads_memory = true;
+        }
+
+        if (die.has(dwarf::DW_AT::type)) {
+            dwarf::die type = die[dwarf::DW_AT::type].as_reference();
+
+            if (type.has(dwarf::DW_AT::byte_size)) {
+                var.size = std::min<std::size_t>(type[dwarf::DW_AT::byte_size].as_uconstant(),
+                                                 sizeof(uint64_t));
+            }
+
+            if (type.has(dwarf::DW_AT::encoding)) {
+                // DW_ATE_signed and DW_ATE_signed_char.
+                uint64_t encoding = type[dwarf::DW_AT::encoding].as_uconstant();
+                var.is_signed = encoding == 0x05 || encoding == 0x06;
+            }
+        }
+
+        m_code.push_back(instruction {opcode::variable, m_variables.size()});
+        m_variables.push_back(var);
+        return;
+    }
+
+    throw std::invalid_argument("Unknown variable " + name);
+}
+
+int64_t breakpoint_expression::evaluate(register_cache &registers, tracee_memory &memory) const {
+    std::vector<int64_t> stack;
+    stack.reserve(m_code.size());
+
+    auto read = [&memory](uint64_t address, std::size_t size, bool is_signed) {
+        uint64_t value = 0;
+        memory.read(address, reinterpret_cast<uint8_t *>(&value), size);
+
+        if (is_signed && size < sizeof(value) && (value >> (8 * size - 1)) & 1) {
+            value |= ~uint64_t {0} << (8 * size);
+        }
+
+        return static_cast<int64_t>(value);
+    };
+
+    for (const instruction &ins : m_code) {
+        switch (ins.op) {
+            case opcode::constant:
+                stack.push_back(ins.operand);
+                continue;
+
+            case opcode::variable: {
+                const variable &var = m_variables[ins.operand];
+                ptrace_expr_context context {registers, memory};
+                dwarf::expr_result result = var.location.evaluate(&context);
+
+                if (result.location_type == dwarf::expr_result::type::reg) {
+                    stack.push_back(
+                        get_register_value_from_dwarf_register(registers.get(), result.value));
+                } else {
+                    stack.push_back(read(result.value + var.bias, var.size, var.is_signed));
+                }
+
+                continue;
+            }
+
+            case opcode::reg:
+                stack.push_back(registers.get(static_cast<reg>(ins.operand)));
+                continue;
+
+            case opcode::deref:
+                stack.back() = read(stack.back(), sizeof(uint64_t), false);
+                continue;
+
+            case opcode::negate:
+                stack.back() = static_cast<int64_t>(0 - static_cast<uint64_t>(stack.back()));
+                continue;
+
+            case opcode::logical_not:
+                stack.back() = !stack.back();
+                continue;
+
+            case opcode::bit_not:
+                stack.back() = ~stack.back();
+                continue;
+
+            default:
+                break;
+        }
+
+        int64_t b = stack.back();
+        stack.pop_back();
+        int64_t &a = stack.back();
+
+        // Arithmetic wraps around like the tracee's would, rather than
+        // overflowing. Division by 0 gives 0, and by -1 is negation, since
+        // INT64_MIN / -1 traps.
+        uint64_t ua = a;
+        uint64_t ub = b;
+
+        switch (ins.op) {
+            case opcode::mul: a = static_cast<int64_t>(ua * ub); break;
+            case opcode::div:
+                a = b == 0 ? 0 : b == -1 ? static_cast<int64_t>(0 - ua) : a / b;
+                break;
+            case opcode::mod: a = b == 0 || b == -1 ? 0 : a % b; break;
+            case opcode::add: a = static_cast<int64_t>(ua + ub); break;
+            case opcode::sub: a = static_cast<int64_t>(ua - ub); break;
+            // Shifts by 64 or more, or by a negative count, give 0.
+            case opcode::shl: a = ub >= 64 ? 0 : static_cast<int64_t>(ua << ub); break;
+            case opcode::shr: a = ub >= 64 ? 0 : a >> b; break;
+            case opcode::lt: a = a < b; break;
+            case opcode::le: a = a <= b; break;
+            case opcode::gt: a = a > b; break;
+            case opcode::ge: a = a >= b; break;
+            case opcode::eq: a = a == b; break;
+            case opcode::ne: a = a != b; break;
+            case opcode::bit_and: a &= b; break;
+            case opcode::bit_xor: a ^= b; break;
+            case opcode::bit_or: a |= b; break;
+            case opcode::logical_and: a = a && b; break;
+            case opcode::logical_or: a = a || b; break;
+            default: break;
+        }
+    }
+
+    return stack.back();
+}
+
+// The log format of a tracepoint: text with embedded "{expr}" or
+// "{expr:x}" expressions, printed in decimal or hexadecimal.
+class tracepoint_format {
+public:
+    tracepoint_format(const std::string &text, const dwarf::die &func, uint64_t bias);
+
+    std::string format(register_cache &registers, tracee_memory &memory) const;
+
+    const std::string &get_text() const {
+        return m_text;
+    }
+
+    bool reads_memory() const;
+
+private:
+    struct segment {
+        std::string literal;
+        std::shared_ptr<const breakpoint_expression> expression;
+        bool hex;
+    };
+
+    std::string m_text;
+    std::vector<segment> m_segments;
+};
+
+tracepoint_format::tracepoint_format(const std::string &text, const dwarf::die &func,
+                                     uint64_t bias)
+    : m_text{text} {
+    std::size_t pos = 0;
+
+    while (pos < text.size()) {
+        std::size_t open = text.find('{', pos);
+        segment seg {text.substr(pos, open - pos), nullptr, false};
+
+        if (open != std::string::npos) {
+            std::size_t close = text.find('}', open);
+
+            if (close == std::string::npos) {
+                throw std::invalid_argument("Expected '}' in tracepoint format");
+            }
+
+            std::string expression = text.substr(open + 1, close - open - 1);
+
+            if (is_suffix(":x", expression)) {
+                expression.resize(expression.size() - 2);
+                seg.hex = true;
+            }
+
+            seg.expression = std::make_shared<breakpoint_expression>(expression, func, bias);
+            pos = close + 1;
+        } else {
+            pos = text.size();
+        }
+
+        m_segments.push_back(seg);
+    }
+}
+
+bool tracepoint_format::reads_memory() const {
+    for (const segment &seg : m_segments) {
+        if (seg.expression && seg.expression->reads_memory()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+std::string tracepoint_format::format(register_cache &registers, tracee_memory &memory) const {
+    std::stringstream out;
+
+    for (const segment &seg : m_segments) {
+        out << seg.literal;
+
+        if (seg.expression) {
+            int64_t value = seg.expression->evaluate(registers, memory);
+
+            if (seg.hex) {
+                out << "0x" << std::hex << value << std::dec;
+            } else {
+                out << value;
+            }
+        }
+    }
+
+    return out.str();
+}
+
+enum class debug_condition {
+    execute = 0,
+    write = 1,
+    read_write = 3,
+};
+
+const std::size_t n_debug_slots = 4;
+
+// Programs the x86 debug registers of the tracee: DR0-DR3 hold addresses,
+// DR7 enables them and selects their condition and length, and DR6
+// reports which of them fired.
+class debug_registers {
+public:
+    debug_registers(pid_t pid) : m_threads{pid}, m_slots{} {}
+
+    // Debug registers are per thread, so every slot is mirrored into each
+    // thread of the tracee.
+    void add_thread(pid_t tid);
+    void remove_thread(pid_t tid);
+
+    // Writes the slots to a thread that was running when they last
+    // changed. Must be called whenever a thread stops.
+    void refresh(pid_t tid);
+
+    int set(uint64_t address, debug_condition condition, std::size_t size);
+    void remove(int slot);
+    void enable(int slot);
+    void disable(int slot);
+
+    // Frees every slot.
+    void clear();
+
+    // Returns the slot of the enabled execution breakpoint at an address,
+    // or -1 if there is none.
+    int find_execute(uint64_t address) const;
+
+    // Returns the slot that caused the last debug trap in a thread, or -1
+    // if there is none, and clears its DR6.
+    int get_triggered(pid_t tid);
+
+    bool is_used(int slot) const {
+        return slot >= 0 && slot < static_cast<int>(n_debug_slots) && m_slots[slot].used;
+    }
+
+    uint64_t get_address(int slot) const {
+        return m_slots[slot].address;
+    }
+
+    debug_condition get_condition(int slot) const {
+        return m_slots[slot].condition;
+    }
+
+    std::size_t get_size(int slot) const {
+        return m_slots[slot].size;
+    }
+
+private:
+    struct slot {
+        bool used;
+        bool enabled;
+        uint64_t address;
+        debug_condition condition;
+        std::size_t size;
+    };
+
+    std::vector<pid_t> m_threads;
+    // Threads that missed a change because they were running.
+    std::unordered_set<pid_t> m_stale;
+    std::array<slot, n_debug_slots> m_slots;
+
+    uint64_t peek(pid_t tid, int n);
+    void poke(pid_t tid, int n, uint64_t value);
+    void poke_all(int n, uint64_t value);
+    uint64_t get_control() const;
+    void update_control();
+};
+
+void debug_registers::add_thread(pid_t tid) {
+    m_threads.push_back(tid);
+
+    for (std::size_t i = 0; i < n_debug_slots; i++) {
+        if (m_slots[i].used) {
+            poke(tid, i, m_slots[i].address);
+        }
+    }
+
+    update_control();
+}
+
+void debug_registers::remove_thread(pid_t tid) {
+    m_threads.erase(std::remove(m_threads.begin(), m_threads.end(), tid), m_threads.end());
+    m_stale.erase(tid);
+}
+
+void debug_registers::refresh(pid_t tid) {
+    if (!m_stale.erase(tid)) {
+        return;
+    }
+
+    for (std::size_t i = 0; i < n_debug_slots; i++) {
+        poke(tid, i, m_slots[i].used ? m_slots[i].address : 0);
+    }
+
+    poke(tid, 7, get_control());
+}
+
+int debug_registers::set(uint64_t address, debug_condition condition, std::size_t size) {
+    if (size != 1 && size != 2 && size != 4 && size != 8) {
+        throw std::invalid_argument("Length must be 1, 2, 4 or 8");
+    }
+
+    if (address % size != 0) {
+        throw std::invalid_argument("Address must be aligned to its length");
+    }
+
+    for (std::size_t i = 0; i < n_debug_slots; i++) {
+        if (!m_slots[i].used) {
+            m_slots[i] = slot {true, true, address, condition, size};
+            poke_all(i, address);
+            update_control();
+            return i;
+        }
+    }
+
+    throw std::runtime_error("No free debug registers");
+}
+
+void debug_registers::remove(int slot) {
+    if (!is_used(slot)) {
+        throw std::out_of_range("Unknown debug register " + std::to_string(slot));
+    }
+
+    m_slots[slot].used = false;
+    m_slots[slot].enabled = false;
+    update_control();
+    poke_all(slot, 0);
+}
+
+void debug_registers::enable(int slot) {
+    m_slots[slot].enabled = true;
+    update_control();
+}
+
+void debug_registers::disable(int slot) {
+    m_slots[slot].enabled = false;
+    update_control();
+}
+
+void debug_registers::clear() {
+    m_slots = {};
+    update_control();
+}
+
+int debug_registers::find_execute(uint64_t address) const {
+    for (std::size_t i = 0; i < n_debug_slots; i++) {
+        const slot &s = m_slots[i];
+
+        if (s.used && s.enabled && s.condition == debug_condition::execute &&
+            s.address == address) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int debug_registers::get_triggered(pid_t tid) {
+    uint64_t status = peek(tid, 6);
+    poke(tid, 6, 0);
+
+    for (std::size_t i = 0; i < n_debug_slots; i++) {
+        if (m_slots[i].used && (status & (1 << i))) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+uint64_t debug_registers::peek(pid_t tid, int n) {
+    return ptrace(PTRACE_PEEKUSER, tid, offsetof(user, u_debugreg) + n * sizeof(uint64_t),
+                  nullptr);
+}
+
+void debug_registers::poke(pid_t tid, int n, uint64_t value) {
+    if (ptrace(PTRACE_POKEUSER, tid, offsetof(user, u_debugreg) + n * sizeof(uint64_t),
+               value) == -1) {
+        throw std::runtime_error("Cannot set debug register");
+    }
+}
+
+// Threads that are running can't be written to, so they are written to
+// by refresh when they next stop.
+void debug_registers::poke_all(int n, uint64_t value) {
+    for (pid_t tid : m_threads) {
+        if (ptrace(PTRACE_POKEUSER, tid, offsetof(user, u_debugreg) + n * sizeof(uint64_t),
+                   value) == -1) {
+            if (errno != ESRCH) {
+                throw std::runtime_error("Cannot set debug register");
+            }
+
+            m_stale.insert(tid);
+        }
+    }
+}
+
+uint64_t debug_registers::get_control() const {
+    uint64_t control = 0;
+
+    for (std::size_t i = 0; i < n_debug_slots; i++) {
+        const slot &s = m_slots[i];
+
+        if (!s.used || !s.enabled) {
+            continue;
+        }
+
+        // Lengths of 1, 2, 4 and 8 bytes are encoded as 0, 1, 3 and 2.
+        uint64_t length = s.size == 8 ? 2 : s.size - 1;
+
+        control |= 1 << (2 * i);
+        control |= static_cast<uint64_t>(s.condition) << (16 + 4 * i);
+        control |= length << (18 + 4 * i);
+    }
+
+    return control;
+}
+
+void debug_registers::update_control() {
+    poke_all(7, get_control());
+}
+
+// Keeps the int3 bytes of every enabled breakpoint in the tracee. Inserting
+// or removing one only queues the change, and apply writes all queued
+// changes in one pass before the tracee next runs: the changes are sorted,
+// and each page that has any is read and written back once. The sites in
+// memory and their saved bytes are kept in a flat array sorted by address.
+class breakpoint_sites {
+public:
+    breakpoint_sites(tracee_memory &memory) : m_memory{memory} {}
+    breakpoint_sites(const breakpoint_sites &) = delete;
+    breakpoint_sites &operator=(const breakpoint_sites &) = delete;
+
+    void insert(uint64_t address);
+    void remove(uint64_t address);
+    void apply();
+
+    // Drops a site without writing to the tracee, for code that has been
+    // unmapped.
+    void forget(uint64_t address);
+
+    // Replaces the int3 bytes in data, read from address in the tracee,
+    // with the bytes they replaced.
+    void restore(uint64_t address, uint8_t *data, std::size_t size) const;
+
+private:
+    struct site {
+        uint64_t address;
+        uint8_t saved;
+    };
+
+    struct change {
+        uint64_t address;
+        bool insert;
+    };
+
+    tracee_memory &m_memory;
+    std::vector<site> m_sites;
+    std::vector<change> m_changes;
+};
+
+// The address is read right away so that a bad one is reported here.
+void breakpoint_sites::insert(uint64_t address) {
+    uint8_t data;
+    m_memory.read(address, &data, 1);
+    m_changes.push_back(change {address, true});
+}
+
+void breakpoint_sites::remove(uint64_t address) {
+    m_changes.push_back(change {address, false});
+}
+
+void breakpoint_sites::apply() {
+    if (m_changes.empty()) {
+        return;
+    }
+
+    std::stable_sort(m_changes.begin(), m_changes.end(),
+                     [](const change &a, const change &b) { return a.address < b.address; });
+
+    auto find = [this](uint64_t address) {
+        return std::lower_bound(
+            m_sites.begin(), m_sites.end(), address,
+            [](const site &s, uint64_t address) { return s.address < address; });
+    };
+
+    // The last change to each address wins. Both lists come out sorted.
+    std::vector<uint64_t> added;
+    std::vector<uint64_t> removed;
+
+    for (std::size_t i = 0; i < m_changes.size(); i++) {
+        const change &c = m_changes[i];
+
+        if (i + 1 < m_changes.size() && m_changes[i + 1].address == c.address) {
+            continue;
+        }
+
+        auto it = find(c.address);
+        bool present = it != m_sites.end() && it->address == c.address;
+
+        if (c.insert && !present) {
+            added.push_back(c.address);
+        } else if (!c.insert && present) {
+            removed.push_back(c.address);
+        }
+    }
+
+    std::vector<site> new_sites;
+    std::vector<uint64_t> done_removed;
+    std::vector<uint64_t> failed_pages;
+    std::size_t i = 0;
+    std::size_t j = 0;
+
+    // Each page is patched in a buffer covering its first to last change.
+    // A page that can't be patched keeps its old sites, and the others
+    // still go ahead.
+    while (i < added.size() || j < removed.size()) {
+        uint64_t first = j == removed.size() || (i < added.size() && added[i] < removed[j])
+                             ? added[i]
+                             : removed[j];
+        uint64_t page_end = (first & ~(page_size - 1)) + page_size;
+
+        std::size_t i_end = i;
+        std::size_t j_end = j;
+
+        while (i_end < added.size() && added[i_end] < page_end) {
+            i_end++;
+        }
+
+        while (j_end < removed.size() && removed[j_end] < page_end) {
+            j_end++;
+        }
+
+        uint64_t last = std::max(i_end > i ? added[i_end - 1] : 0,
+                                 j_end > j ? removed[j_end - 1] : 0);
+        std::vector<uint8_t> buffer(last - first + 1);
+
+        try {
+            m_memory.read(first, buffer.data(), buffer.size());
+        } catch (std::runtime_error &) {
+            failed_pages.push_back(first & ~(page_size - 1));
+            i = i_end;
+            j = j_end;
+            continue;
+        }
+
+        std::vector<site> page_sites;
+
+        for (std::size_t k = i; k < i_end; k++) {
+            page_sites.push_back(site {added[k], buffer[added[k] - first]});
+            buffer[added[k] - first] = 0xCC;
+        }
+
+        for (std::size_t k = j; k < j_end; k++) {
+            buffer[removed[k] - first] = find(removed[k])->saved;
+        }
+
+        try {
+            m_memory.write(first, buffer.data(), buffer.size());
+        } catch (std::runtime_error &) {
+            failed_pages.push_back(first & ~(page_size - 1));
+            i = i_end;
+            j = j_end;
+            continue;
+        }
+
+        new_sites.insert(new_sites.end(), page_sites.begin(), page_sites.end());
+        done_removed.insert(done_removed.end(), removed.begin() + j, removed.begin() + j_end);
+        i = i_end;
+        j = j_end;
+    }
+
+    if (!done_removed.empty()) {
+        m_sites.erase(std::remove_if(m_sites.begin(), m_sites.end(),
+                                     [&done_removed](const site &s) {
+                                         return std::binary_search(done_removed.begin(),
+                                                                   done_removed.end(), s.address);
+                                     }),
+                      m_sites.end());
+    }
+
+    if (!new_sites.empty()) {
+        std::vector<site> merged;
+        merged.reserve(m_sites.size() + new_sites.size());
+        std::merge(m_sites.begin(), m_sites.end(), new_sites.begin(), new_sites.end(),
+                   std::back_inserter(merged),
+                   [](const site &a, const site &b) { return a.address < b.address; });
+        m_sites = std::move(merged);
+    }
+
+    m_changes.clear();
+
+    if (!failed_pages.empty()) {
+        std::stringstream message;
+        message << "Cannot write breakpoints in the page at 0x" << std::hex << failed_pages[0];
+
+        if (failed_pages.size() > 1) {
+            message << " and " << std::dec << failed_pages.size() - 1 << " more";
+        }
+
+        throw std::runtime_error(message.str());
+    }
+}
+
+void breakpoint_sites::forget(uint64_t address) {
+    m_changes.erase(std::remove_if(m_changes.begin(), m_changes.end(),
+                                   [address](const change &c) { return c.address == address; }),
+                    m_changes.end());
+    m_sites.erase(std::remove_if(m_sites.begin(), m_sites.end(),
+                                 [address](const site &s) { return s.address == address; }),
+                  m_sites.end());
+}
+
+void breakpoint_sites::restore(uint64_t address, uint8_t *data, std::size_t size) const {
+    auto it = std::lower_bound(
+        m_sites.begin(), m_sites.end(), address,
+        [](const site &s, uint64_t address) { return s.address < address; });
+
+    for (; it != m_sites.end() && it->address < address + size; it++) {
+        data[it->address - address] = it->saved;
+    }
+}
+
+class breakpoint {
+public:
+    breakpoint(breakpoint_sites &sites, std::intptr_t address)
+        : m_sites{sites}, m_address{address}, m_enabled{false}, m_hit_count{0},
+          m_ignore_count{0} {}
+
+    void enable();
+    void disable();
+
+    bool is_enabled() const {
+        return m_enabled;
+    }
+
+    std::intptr_t get_address() const {
+        return m_address;
+    }
+
+    const breakpoint_expression *get_condition() const {
+        return m_condition.get();
+    }
+
+    void set_condition(std::shared_ptr<const breakpoint_expression> condition) {
+        m_condition = std::move(condition);
+    }
+
+    const tracepoint_format *get_trace_format() const {
+        return m_trace_format.get();
+    }
+
+    void set_trace_format(std::shared_ptr<const tracepoint_format> format) {
+        m_trace_format = std::move(format);
+    }
+
+    uint64_t get_hit_count() const {
+        return m_hit_count;
+    }
+
+    uint64_t get_ignore_count() const {
+        return m_ignore_count;
+    }
+
+    void set_ignore_count(uint64_t count) {
+        m_ignore_count = count;
+    }
+
+    // Counts a hit whose condition held. Returns false if the hit should
+    // be ignored.
+    bool hit();
+
+private:
+    breakpoint_sites &m_sites;
+    std::intptr_t m_address;
+    bool m_enabled;
+    std::shared_ptr<const breakpoint_expression> m_condition;
+    std::shared_ptr<const tracepoint_format> m_trace_format;
+    uint64_t m_hit_count;
+    uint64_t m_ignore_count;
+};
+
+bool breakpoint::hit() {
+    m_hit_count++;
+
+    if (m_ignore_count > 0) {
+        m_ignore_count--;
+        return false;
+    }
+
+    return true;
+}
+
+// The int3 is written when the tracee is next resumed.
+void breakpoint::enable() {
+    m_sites.insert(m_address);
+    m_enabled = true;
+}
+
+void breakpoint::disable() {
+    m_sites.remove(m_address);
+    m_enabled = false;
+}
+
+// Maps addresses to the subprogram and inlined subroutine DIEs covering
+// them. Ranges are kept sorted by start address, and each range links to
+// the innermost range enclosing it, so lookups are a binary search.
+class function_index {
+public:
+    struct entry {
+        dwarf::taddr low;
+        dwarf::taddr high;
+        unsigned depth;
+        std::ptrdiff_t parent;
+        dwarf::die die;
+    };
+
+    void add(const dwarf::compilation_unit &cu);
+    void merge(const function_index &other);
+    void finalize();
+
+    // Returns the enclosing DIEs of an address, innermost first.
+    std::vector<dwarf::die> find(dwarf::taddr pc) const;
+
+    const std::vector<entry> &get_entries() const {
+        return m_entries;
+    }
+
+private:
+    std::vector<entry> m_entries;
+
+    void add_die(const dwarf::die &die, unsigned depth);
+};
+
+void function_index::add(const dwarf::compilation_unit &cu) {
+    add_die(cu.root(), 0);
+}
+
+void function_index::merge(const function_index &other) {
+    m_entries.insert(m_entries.end(), other.m_entries.begin(), other.m_entries.end());
+}
+
+void function_index::add_die(const dwarf::die &die, unsigned depth) {
+    for (const dwarf::die &child : die) {
+        unsigned child_depth = depth;
+
+        if (child.tag == dwarf::DW_TAG::subprogram ||
+            child.tag == dwarf::DW_TAG::inlined_subroutine) {
+            for (const dwarf::rangelist::entry &range : die_pc_range(child)) {
+                if (range.low < range.high) {
+                    m_entries.push_back(entry {range.low, range.high, depth, -1, child});
+                }
+            }
+
+            child_depth++;
+        }
+
+        add_die(child, child_depth);
+    }
+}
+
+void function_index::finalize() {
+    std::sort(m_entries.begin(), m_entries.end(), [](const entry &a, const entry &b) {
+        if (a.low != b.low) {
+            return a.low < b.low;
+        }
+
+        if (a.high != b.high) {
+            return a.high > b.high;
+        }
+
+        return a.depth < b.depth;
+    });
+
+    std::vector<std::ptrdiff_t> enclosing;
+
+    for (std::size_t i = 0; i < m_entries.size(); i++) {
+        entry &e = m_entries[i];
+
+        while (!enclosing.empty() && m_entries[enclosing.back()].high < e.high) {
+            enclosing.pop_back();
+        }
+
+        e.parent = enclosing.empty() ? -1 : enclosing.back();
+        enclosing.push_back(i);
+    }
+}
+
+std::vector<dwarf::die> function_index::find(dwarf::taddr pc) const {
+    std::vector<dwarf::die> dies;
+
+    auto it = std::upper_bound(m_entries.begin(), m_entries.end(), pc,
+                               [](dwarf::taddr pc, const entry &e) { return pc < e.low; });
+    std::ptrdiff_t i = (it - m_entries.begin()) - 1;
+
+    while (i >= 0) {
+        const entry &e = m_entries[i];
+
+        if (pc < e.high) {
+            dies.push_back(e.die);
+        }
+
+        i = e.parent;
+    }
+
+    return dies;
+}
+
+// Maps addresses to compilation units, using .debug_aranges where it is
+// present and the PC ranges of the unit DIEs otherwise.
+class compilation_unit_index {
+public:
+    // Returns the units covered by .debug_aranges.
+    std::unordered_set<const dwarf::compilation_unit *> add_aranges(const elf::elf &elf,
+                                                                    const dwarf::dwarf &dwarf);
+    void add(dwarf::taddr low, dwarf::taddr high, const dwarf::compilation_unit *cu);
+    void finalize();
+    const dwarf::compilation_unit *find(dwarf::taddr pc) const;
+
+    struct entry {
+        dwarf::taddr low;
+        dwarf::taddr high;
+        const dwarf::compilation_unit *cu;
+    };
+
+    const std::vector<entry> &get_entries() const {
+        return m_entries;
+    }
+
+private:
+    std::vector<entry> m_entries;
+
+    void add_aranges(const elf::section &section,
+                     const std::unordered_map<dwarf::section_offset,
+                                              const dwarf::compilation_unit *> &units);
+};
+
+std::unordered_set<const dwarf::compilation_unit *> compilation_unit_index::add_aranges(
+    const elf::elf &elf, const dwarf::dwarf &dwarf) {
+    std::unordered_map<dwarf::section_offset, const dwarf::compilation_unit *> units;
+
+    for (const dwarf::compilation_unit &cu : dwarf.compilation_units()) {
+        units.emplace(cu.get_section_offset(), &cu);
+    }
+
+    const elf::section &aranges = elf.get_section(".debug_aranges");
+
+    if (aranges.valid()) {
+        add_aranges(aranges, units);
+    }
+
+    std::unordered_set<const dwarf::compilation_unit *> covered;
+
+    for (const entry &e : m_entries) {
+        covered.insert(e.cu);
+    }
+
+    finalize();
+    return covered;
+}
+
+void compilation_unit_index::add(dwarf::taddr low, dwarf::taddr high,
+                                 const dwarf::compilation_unit *cu) {
+    m_entries.push_back(entry {low, high, cu});
+}
+
+void compilation_unit_index::finalize() {
+    std::sort(m_entries.begin(), m_entries.end(),
+              [](const entry &a, const entry &b) { return a.low < b.low; });
+}
+
+void compilation_unit_index::add_aranges(
+    const elf::section &section,
+    const std::unordered_map<dwarf::section_offset, const dwarf::compilation_unit *> &units) {
+    const uint8_t *begin = static_cast<const uint8_t *>(section.data());
+    const uint8_t *end = begin + section.size();
+
+    auto read = [](const uint8_t *&cursor, std::size_t size) {
+        uint64_t value = 0;
+        std::memcpy(&value, cursor, size);
+        cursor += size;
+        return value;
+    };
+
+    const uint8_t *set = begin;
+
+    while (end - set >= 4) {
+        const uint8_t *cursor = set;
+        std::size_t offset_size = 4;
+        uint64_t length = read(cursor, 4);
+
+        if (length == 0xffffffff) {
+            offset_size = 8;
+            length = read(cursor, 8);
+        }
+
+        if (length == 0 || length > static_cast<uint64_t>(end - cursor)) {
+            break;
+        }
+
+        const uint8_t *next = cursor + length;
+
+        cursor += 2; // Skip version.
+        dwarf::section_offset info_offset = read(cursor, offset_size);
+        std::size_t address_size = read(cursor, 1);
+        cursor += 1; // Skip segment selector size.
+
+        auto unit = units.find(info_offset);
+
+        if (unit == units.end() || address_size == 0 || address_size > 8) {
+            set = next;
+            continue;
+        }
+
+        // Tuples are aligned to twice the address size from the set start.
+        std::size_t tuple_size = 2 * address_size;
+        cursor = set + (cursor - set + tuple_size - 1) / tuple_size * tuple_size;
+
+        while (next - cursor >= static_cast<std::ptrdiff_t>(tuple_size)) {
+            dwarf::taddr address = read(cursor, address_size);
+            dwarf::taddr range_length = read(cursor, address_size);
+
+            if (address == 0 && range_length == 0) {
+                break;
+            }
+
+            m_entries.push_back(entry {address, address + range_length, unit->second});
+        }
+
+        set = next;
+    }
+}
+
+const dwarf::compilation_unit *compilation_unit_index::find(dwarf::taddr pc) const {
+    auto it = std::upper_bound(m_entries.begin(), m_entries.end(), pc,
+                               [](dwarf::taddr pc, const entry &e) { return pc < e.low; });
+
+    if (it == m_entries.begin()) {
+        return nullptr;
+    }
+
+    it--;
+    return pc < it->high ? it->cu : nullptr;
+}
+
+// Indexes values by name. Besides exact names, searches accept prefix
+// patterns of the form "name*" and regular expressions of the form "/re/".
+template <typename T>
+class name_index {
+public:
+    void add(const std::string &name, T value);
+    void finalize();
+    std::vector<T> search(const std::string &pattern) const;
+
+    const std::unordered_map<std::string, std::vector<T>> &get_entries() const {
+        return m_entries;
+    }
+
+private:
+    std::unordered_map<std::string, std::vector<T>> m_entries;
+    std::vector<std::string> m_names;
+
+    void append(const std::string &name, std::vector<T> &values) const;
+};
+
+template <typename T>
+void name_index<T>::add(const std::string &name, T value) {
+    m_entries[name].push_back(std::move(value));
+}
+
+template <typename T>
+void name_index<T>::finalize() {
+    m_names.clear();
+    m_names.reserve(m_entries.size());
+
+    for (const auto &entry : m_entries) {
+        m_names.push_back(entry.first);
+    }
+
+    std::sort(m_names.begin(), m_names.end());
+}
+
+template <typename T>
+std::vector<T> name_index<T>::search(const std::string &pattern) const {
+    std::vector<T> values;
+
+    if (pattern.size() > 1 && pattern.front() == '/' && pattern.back() == '/') {
+        std::regex re {pattern.substr(1, pattern.size() - 2)};
+
+        for (const std::string &name : m_names) {
+            if (std::regex_search(name, re)) {
+                append(name, values);
+            }
+        }
+    } else if (!pattern.empty() && pattern.back() == '*') {
+        std::string prefix = pattern.substr(0, pattern.size() - 1);
+        auto it = std::lower_bound(m_names.begin(), m_names.end(), prefix);
+
+        for (; it != m_names.end() && is_prefix(prefix, *it); it++) {
+            append(*it, values);
+        }
+    } else {
+        append(pattern, values);
+    }
+
+    return values;
+}
+
+template <typename T>
+void name_index<T>::append(const std::string &name, std::vector<T> &values) const {
+    auto it = m_entries.find(name);
+
+    if (it != m_entries.end()) {
+        values.insert(values.end(), it->second.begin(), it->second.end());
+    }
+}
+
+// Returns the name of a function DIE, following references to its
+// declaration or abstract instance within the same unit. References to
+// other units are not followed, so that indexing a unit never touches
+// another one.
+std::string get_function_name(const dwarf::die &die) {
+    if (die.has(dwarf::DW_AT::name)) {
+        return at_name(die);
+    }
+
+    for (dwarf::DW_AT attr : {dwarf::DW_AT::specification, dwarf::DW_AT::abstract_origin}) {
+        if (!die.has(attr)) {
+            continue;
+        }
+
+        dwarf::value ref = die[attr];
+
+        if (ref.get_form() != dwarf::DW_FORM::ref_addr) {
+            return get_function_name(ref.as_reference());
+        }
+    }
+
+    return "";
+}
+
+void index_function_names(const dwarf::die &die, name_index<dwarf::die> &names) {
+    for (const dwarf::die &child : die) {
+        if (child.tag == dwarf::DW_TAG::subprogram && child.has(dwarf::DW_AT::low_pc)) {
+            std::string name = get_function_name(child);
+
+            if (!name.empty()) {
+                names.add(name, child);
+            }
+        }
+
+        index_function_names(child, names);
+    }
+}
+
+// Returns the DIE at a section offset, descending from the unit root
+// through the child that contains it at each level.
+dwarf::die find_die(const dwarf::compilation_unit &cu, dwarf::section_offset offset) {
+    dwarf::die die = cu.root();
+
+    while (die.get_section_offset() != offset) {
+        dwarf::die next;
+        bool found = false;
+
+        for (const dwarf::die &child : die) {
+            if (child.get_section_offset() > offset) {
+                break;
+            }
+
+            next = child;
+            found = true;
+        }
+
+        if (!found) {
+            throw std::out_of_range("Unknown DIE");
+        }
+
+        die = next;
+    }
+
+    return die;
+}
+
+// Records the function DIEs below die by section offset.
+void index_function_dies(const dwarf::die &die,
+                         std::unordered_map<dwarf::section_offset, dwarf::die> &dies) {
+    for (const dwarf::die &child : die) {
+        if (child.tag == dwarf::DW_TAG::subprogram ||
+            child.tag == dwarf::DW_TAG::inlined_subroutine) {
+            dies.emplace(child.get_section_offset(), child);
+        }
+
+        index_function_dies(child, dies);
+    }
+}
+
+// Unit ranges, function ranges and function names of a binary, stored on
+// disk in a flat layout that is used in place through mmap. DIEs are
+// referred to by unit number and section offset.
+class index_cache {
+public:
+    struct die_ref {
+        uint32_t unit;
+        dwarf::section_offset offset;
+    };
+
+    struct unit_range {
+        uint64_t low;
+        uint64_t high;
+        uint64_t unit;
+    };
+
+    struct function {
+        uint64_t low;
+        uint64_t high;
+        int64_t parent;
+        uint64_t offset;
+        uint64_t unit;
+    };
+
+    struct name {
+        uint64_t string;
+        uint64_t length;
+        uint64_t offset;
+        uint64_t unit;
+    };
+
+    index_cache(const index_cache &) = delete;
+    index_cache &operator=(const index_cache &) = delete;
+    ~index_cache();
+
+    static std::string get_path(const elf::elf &elf, const std::string &filename);
+    static std::unique_ptr<index_cache> open(const std::string &path, std::size_t n_units);
+    static void write(const std::string &path, std::size_t n_units,
+                      std::vector<unit_range> unit_ranges,
+                      const std::vector<function> &functions,
+                      std::vector<std::pair<std::string, die_ref>> names);
+
+    bool find_unit(dwarf::taddr pc, uint32_t &unit) const;
+    std::vector<die_ref> find_functions(dwarf::taddr pc) const;
+    std::vector<die_ref> search_functions(const std::string &pattern) const;
+
+private:
+    struct header {
+        char magic[8];
+        uint64_t n_units;
+        uint64_t n_unit_ranges;
+        uint64_t n_functions;
+        uint64_t n_names;
+        uint64_t strings_size;
+    };
+
+    static constexpr char magic[8] = {'d', 'b', 'g', 'i', 'd', 'x', '0', '1'};
+
+    void *m_data;
+    std::size_t m_size;
+    const header *m_header;
+    const unit_range *m_unit_ranges;
+    const function *m_functions;
+    const name *m_names;
+    const char *m_strings;
+
+    index_cache(void *data, std::size_t size);
+
+    std::string get_name(const name &n) const {
+        return std::string(m_strings + n.string, n.length);
+    }
+};
+
+constexpr char index_cache::magic[8];
+
+index_cache::index_cache(void *data, std::size_t size)
+    : m_data{data}, m_size{size}, m_header{static_cast<const header *>(data)} {
+    m_unit_ranges = reinterpret_cast<const unit_range *>(m_header + 1);
+    m_functions = reinterpret_cast<const function *>(m_unit_ranges + m_header->n_unit_ranges);
+    m_names = reinterpret_cast<const name *>(m_functions + m_header->n_functions);
+    m_strings = reinterpret_cast<const char *>(m_names + m_header->n_names);
+}
+
+index_cache::~index_cache() {
+    munmap(m_data, m_size);
+}
+
+std::string index_cache::get_path(const elf::elf &elf, const std::string &filename) {
+    std::stringstream key;
+    key << std::hex << std::setfill('0');
+
+    const elf::section &note = elf.get_section(".note.gnu.build-id");
+
+    if (note.valid() && note.size() > 12) {
+        const uint8_t *data = static_cast<const uint8_t *>(note.data());
+        uint32_t name_size, desc_size;
+        std::memcpy(&name_size, data, 4);
+        std::memcpy(&desc_size, data + 4, 4);
+
+        std::size_t desc_offset = 12 + ((name_size + 3) & ~3);
+
+        if (desc_offset + desc_size <= note.size()) {
+            for (std::size_t i = 0; i < desc_size; i++) {
+                key << std::setw(2) << static_cast<unsigned>(data[desc_offset + i]);
+            }
+        }
+    }
+
+    if (key.str().empty()) {
+        struct stat st;
+        char *real_path = realpath(filename.c_str(), nullptr);
+
+        if (!real_path || stat(real_path, &st) == -1) {
+            free(real_path);
+            return "";
+        }
+
+        key << std::hash<std::string> {}(real_path) << '-' << st.st_size << '-'
+            << st.st_mtime;
+        free(real_path);
+    }
+
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    std::string dir;
+
+    if (cache_home && *cache_home) {
+        dir = cache_home;
+    } else if (const char *home = getenv("HOME")) {
+        dir = std::string {home} + "/.cache";
+    } else {
+        return "";
+    }
+
+    return dir + "/dbg/" + key.str() + ".idx";
+}
+
+std::unique_ptr<index_cache> index_cache::open(const std::string &path, std::size_t n_units) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || static_cast<std::size_t>(st.st_size) < sizeof(header)) {
+        close(fd);
+        return nullptr;
+    }
+
+    std::size_t size = st.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+
+    std::unique_ptr<index_cache> cache {new index_cache {data, size}};
+    const header *h = cache->m_header;
+
+    std::size_t expected_size = sizeof(header) + h->n_unit_ranges * sizeof(unit_range) +
+                                h->n_functions * sizeof(function) +
+                                h->n_names * sizeof(name) + h->strings_size;
+
+    if (std::memcmp(h->magic, magic, sizeof(magic)) != 0 || h->n_units != n_units ||
+        expected_size != size) {
+        return nullptr;
+    }
+
+    return cache;
+}
+
+void index_cache::write(const std::string &path, std::size_t n_units,
+                        std::vector<unit_range> unit_ranges,
+                        const std::vector<function> &functions,
+                        std::vector<std::pair<std::string, die_ref>> names) {
+    std::size_t slash = path.rfind('/');
+    std::size_t parent = path.rfind('/', slash - 1);
+    mkdir(path.substr(0, parent).c_str(), 0755);
+    mkdir(path.substr(0, slash).c_str(), 0755);
+
+    std::sort(unit_ranges.begin(), unit_ranges.end(),
+              [](const unit_range &a, const unit_range &b) { return a.low < b.low; });
+    std::sort(names.begin(), names.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    std::string strings;
+    std::vector<name> name_records;
+    name_records.reserve(names.size());
+
+    for (const auto &n : names) {
+        name_records.push_back(name {strings.size(), n.first.size(), n.second.offset,
+                                     n.second.unit});
+        strings += n.first;
+    }
+
+    header h {};
+    std::memcpy(h.magic, magic, sizeof(magic));
+    h.n_units = n_units;
+    h.n_unit_ranges = unit_ranges.size();
+    h.n_functions = functions.size();
+    h.n_names = name_records.size();
+    h.strings_size = strings.size();
+
+    // Write to a temporary file first, so that readers never see a
+    // partially written cache.
+    std::string temp_path = path + "." + std::to_string(getpid());
+    std::ofstream file {temp_path, std::ios::binary};
+    file.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    file.write(reinterpret_cast<const char *>(unit_ranges.data()),
+               unit_ranges.size() * sizeof(unit_range));
+    file.write(reinterpret_cast<const char *>(functions.data()),
+               functions.size() * sizeof(function));
+    file.write(reinterpret_cast<const char *>(name_records.data()),
+               name_records.size() * sizeof(name));
+    file.write(strings.data(), strings.size());
+    file.close();
+
+    if (!file || rename(temp_path.c_str(), path.c_str()) == -1) {
+        unlink(temp_path.c_str());
+    }
+}
+
+bool index_cache::find_unit(dwarf::taddr pc, uint32_t &unit) const {
+    const unit_range *begin = m_unit_ranges;
+    const unit_range *end = begin + m_header->n_unit_ranges;
+    const unit_range *it = std::upper_bound(
+        begin, end, pc, [](dwarf::taddr pc, const unit_range &r) { return pc < r.low; });
+
+    if (it == begin || pc >= (it - 1)->high) {
+        return false;
+    }
+
+    unit = (it - 1)->unit;
+    return true;
+}
+
+std::vector<index_cache::die_ref> index_cache::find_functions(dwarf::taddr pc) const {
+    std::vector<die_ref> refs;
+
+    const function *begin = m_functions;
+    const function *end = begin + m_header->n_functions;
+    const function *it = std::upper_bound(
+        begin, end, pc, [](dwarf::taddr pc, const function &f) { return pc < f.low; });
+    int64_t i = (it - begin) - 1;
+
+    while (i >= 0) {
+        const function &f = m_functions[i];
+
+        if (pc < f.high) {
+            refs.push_back(die_ref {static_cast<uint32_t>(f.unit), f.offset});
+        }
+
+        i = f.parent;
+    }
+
+    return refs;
+}
+
+std::vector<index_cache::die_ref> index_cache::search_functions(
+    const std::string &pattern) const {
+    std::vector<die_ref> refs;
+
+    const name *begin = m_names;
+    const name *end = begin + m_header->n_names;
+    auto append = [&refs](const name &n) {
+        refs.push_back(die_ref {static_cast<uint32_t>(n.unit), n.offset});
+    };
+
+    if (pattern.size() > 1 && pattern.front() == '/' && pattern.back() == '/') {
+        std::regex re {pattern.substr(1, pattern.size() - 2)};
+
+        for (const name *n = begin; n != end; n++) {
+            if (std::regex_search(get_name(*n), re)) {
+                append(*n);
+            }
+        }
+
+        return refs;
+    }
+
+    bool prefix = !pattern.empty() && pattern.back() == '*';
+    std::string key = prefix ? pattern.substr(0, pattern.size() - 1) : pattern;
+    const name *n = std::lower_bound(
+        begin, end, key, [this](const name &n, const std::string &key) {
+            return get_name(n) < key;
+        });
+
+    for (; n != end; n++) {
+        std::string found = get_name(*n);
+
+        if (prefix ? !is_prefix(key, found) : found != key) {
+            break;
+        }
+
+        append(*n);
+    }
+
+    return refs;
+}
+
+// Builds the per-unit indexes on a pool of background threads, one task
+// per compilation unit. Lookups wait only for the units they touch, and
+// build a unit on the calling thread if no worker has picked it up yet.
+// Once every unit is indexed the result is written to an index_cache,
+// which later sessions use instead of indexing again.
+class dwarf_index {
+public:
+    dwarf_index(const elf::elf &elf, const dwarf::dwarf &dwarf, const std::string &filename);
+    dwarf_index(const dwarf_index &) = delete;
+    dwarf_index &operator=(const dwarf_index &) = delete;
+    ~dwarf_index();
+
+    const dwarf::compilation_unit *find_compilation_unit(dwarf::taddr pc);
+    std::vector<dwarf::die> find_functions(dwarf::taddr pc);
+    std::vector<dwarf::die> search_functions(const std::string &pattern);
+    void wait_all();
+
+private:
+    enum class unit_state { pending, building, done };
+
+    struct unit {
+        const dwarf::compilation_unit *cu;
+        bool has_aranges;
+        std::atomic<unit_state> state;
+        std::vector<std::pair<dwarf::taddr, dwarf::taddr>> ranges;
+        function_index functions;
+        name_index<dwarf::die> names;
+    };
+
+    const dwarf::dwarf &m_dwarf;
+    std::string m_cache_path;
+    std::unique_ptr<index_cache> m_cache;
+    std::vector<std::unique_ptr<unit>> m_units;
+    std::unordered_map<const dwarf::unit *, std::size_t> m_unit_numbers;
+    compilation_unit_index m_compilation_units;
+    std::vector<compilation_unit_index::entry> m_aranges;
+    bool m_complete;
+    std::atomic<std::size_t> m_next;
+    std::atomic<std::size_t> m_n_done;
+    std::atomic<bool> m_stopping;
+    std::mutex m_mutex;
+    std::condition_variable m_unit_done;
+    std::vector<std::thread> m_workers;
+
+    void work();
+    void build(unit &u);
+    unit &wait(std::size_t number);
+    void write_cache();
+    dwarf::die get_die(const index_cache::die_ref &ref);
+
+    // The function DIEs of each unit that cached references have been
+    // resolved in, by section offset. A unit is walked once, when the
+    // first reference into it is resolved.
+    std::unordered_map<uint32_t, std::unordered_map<dwarf::section_offset, dwarf::die>>
+        m_cached_dies;
+};
+
+dwarf_index::dwarf_index(const elf::elf &elf, const dwarf::dwarf &dwarf,
+                         const std::string &filename)
+    : m_dwarf{dwarf}, m_complete{false}, m_next{0}, m_n_done{0}, m_stopping{false} {
+    m_cache_path = index_cache::get_path(elf, filename);
+
+    if (!m_cache_path.empty()) {
+        m_cache = index_cache::open(m_cache_path, dwarf.compilation_units().size());
+    }
+
+    if (m_cache) {
+        m_complete = true;
+        return;
+    }
+
+    // libelfin loads sections on first use, so load the ones that DIE
+    // attributes refer to before any worker starts.
+    for (dwarf::section_type type : {dwarf::section_type::str, dwarf::section_type::ranges,
+                                     dwarf::section_type::line, dwarf::section_type::loc}) {
+        try {
+            dwarf.get_section(type);
+        } catch (dwarf::format_error &) {
+        }
+    }
+
+    std::unordered_set<const dwarf::compilation_unit *> covered =
+        m_compilation_units.add_aranges(elf, dwarf);
+
+    for (const dwarf::compilation_unit &cu : dwarf.compilation_units()) {
+        std::unique_ptr<unit> u {new unit};
+        u->cu = &cu;
+        u->has_aranges = covered.count(&cu) > 0;
+        u->state = unit_state::pending;
+
+        m_unit_numbers.emplace(&cu, m_units.size());
+        m_units.push_back(std::move(u));
+    }
+
+    m_aranges = m_compilation_units.get_entries();
+
+    unsigned n_workers = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned i = 0; i < n_workers; i++) {
+        m_workers.emplace_back(&dwarf_index::work, this);
+    }
+}
+
+dwarf_index::~dwarf_index() {
+    m_stopping = true;
+
+    for (std::thread &worker : m_workers) {
+        worker.join();
+    }
+}
+
+void dwarf_index::work() {
+    while (!m_stopping) {
+        std::size_t number = m_next++;
+
+        if (number >= m_units.size()) {
+            return;
+        }
+
+        build(*m_units[number]);
+    }
+}
+
+void dwarf_index::build(unit &u) {
+    unit_state expected = unit_state::pending;
+
+    if (!u.state.compare_exchange_strong(expected, unit_state::building)) {
+        return;
+    }
+
+    try {
+        if (!u.has_aranges) {
+            for (const dwarf::rangelist::entry &range : die_pc_range(u.cu->root())) {
+                if (range.low < range.high) {
+                    u.ranges.emplace_back(range.low, range.high);
+                }
+            }
+        }
+
+        u.functions.add(*u.cu);
+        u.functions.finalize();
+        index_function_names(u.cu->root(), u.names);
+        u.names.finalize();
+    } catch (std::exception &) {
+        // Leave the indexes of a malformed unit incomplete.
+    }
+
+    {
+        std::lock_guard<std::mutex> lock {m_mutex};
+        u.state = unit_state::done;
+    }
+
+    m_unit_done.notify_all();
+
+    if (++m_n_done == m_units.size() && !m_cache_path.empty()) {
+        write_cache();
+    }
+}
+
+void dwarf_index::write_cache() {
+    std::vector<index_cache::unit_range> unit_ranges;
+    function_index functions;
+    std::vector<std::pair<std::string, index_cache::die_ref>> names;
+
+    // Ranges from .debug_aranges went into the unit index up front, before
+    // any other range was added.
+    for (const compilation_unit_index::entry &e : m_aranges) {
+        unit_ranges.push_back(index_cache::unit_range {e.low, e.high, m_unit_numbers.at(e.cu)});
+    }
+
+    for (std::size_t number = 0; number < m_units.size(); number++) {
+        const unit &u = *m_units[number];
+
+        for (const auto &range : u.ranges) {
+            unit_ranges.push_back(index_cache::unit_range {range.first, range.second, number});
+        }
+
+        functions.merge(u.functions);
+
+        for (const auto &entry : u.names.get_entries()) {
+            for (const dwarf::die &die : entry.second) {
+                index_cache::die_ref ref {static_cast<uint32_t>(number),
+                                          die.get_section_offset()};
+                names.emplace_back(entry.first, ref);
+            }
+        }
+    }
+
+    functions.finalize();
+
+    std::vector<index_cache::function> function_records;
+    function_records.reserve(functions.get_entries().size());
+
+    for (const function_index::entry &e : functions.get_entries()) {
+        function_records.push_back(index_cache::function {
+            e.low, e.high, e.parent, e.die.get_section_offset(),
+            m_unit_numbers.at(&e.die.get_unit())});
+    }
+
+    try {
+        index_cache::write(m_cache_path, m_units.size(), std::move(unit_ranges),
+                           function_records, std::move(names));
+    } catch (std::exception &) {
+        // The cache is only an optimisation.
+    }
+}
+
+dwarf::die dwarf_index::get_die(const index_cache::die_ref &ref) {
+    const dwarf::compilation_unit &cu = m_dwarf.compilation_units().at(ref.unit);
+    auto it = m_cached_dies.find(ref.unit);
+
+    if (it == m_cached_dies.end()) {
+        it = m_cached_dies.emplace(ref.unit, decltype(it->second) {}).first;
+        index_function_dies(cu.root(), it->second);
+    }
+
+    auto die = it->second.find(ref.offset);
+
+    if (die != it->second.end()) {
+        return die->second;
+    }
+
+    return find_die(cu, ref.offset);
+}
+
+dwarf_index::unit &dwarf_index::wait(std::size_t number) {
+    unit &u = *m_units[number];
+
+    if (u.state != unit_state::done) {
+        build(u);
+
+        std::unique_lock<std::mutex> lock {m_mutex};
+        m_unit_done.wait(lock, [&u] { return u.state == unit_state::done; });
+    }
+
+    return u;
+}
+
+void dwarf_index::wait_all() {
+    if (m_complete) {
+        return;
+    }
+
+    for (std::size_t number = 0; number < m_units.size(); number++) {
+        unit &u = wait(number);
+
+        for (const auto &range : u.ranges) {
+            m_compilation_units.add(range.first, range.second, u.cu);
+        }
+    }
+
+    m_compilation_units.finalize();
+    m_complete = true;
+}
+
+const dwarf::compilation_unit *dwarf_index::find_compilation_unit(dwarf::taddr pc) {
+    if (m_cache) {
+        uint32_t number;
+        return m_cache->find_unit(pc, number) ? &m_dwarf.compilation_units().at(number)
+                                              : nullptr;
+    }
+
+    const dwarf::compilation_unit *cu = m_compilation_units.find(pc);
+
+    // Units without address range tables are only known once indexed.
+    if (!cu && !m_complete) {
+        wait_all();
+        cu = m_compilation_units.find(pc);
+    }
+
+    if (cu) {
+        wait(m_unit_numbers.at(cu));
+    }
+
+    return cu;
+}
+
+std::vector<dwarf::die> dwarf_index::find_functions(dwarf::taddr pc) {
+    if (m_cache) {
+        std::vector<dwarf::die> dies;
+
+        for (const index_cache::die_ref &ref : m_cache->find_functions(pc)) {
+            dies.push_back(get_die(ref));
+        }
+
+        return dies;
+    }
+
+    const dwarf::compilation_unit *cu = find_compilation_unit(pc);
+
+    if (!cu) {
+        return {};
+    }
+
+    return m_units[m_unit_numbers.at(cu)]->functions.find(pc);
+}
+
+std::vector<dwarf::die> dwarf_index::search_functions(const std::string &pattern) {
+    std::vector<dwarf::die> dies;
+
+    if (m_cache) {
+        for (const index_cache::die_ref &ref : m_cache->search_functions(pattern)) {
+            dies.push_back(get_die(ref));
+        }
+
+        return dies;
+    }
+
+    for (std::size_t number = 0; number < m_units.size(); number++) {
+        std::vector<dwarf::die> found = wait(number).names.search(pattern);
+        dies.insert(dies.end(), found.begin(), found.end());
+    }
+
+    return dies;
+}
+
+// DWARF numbers 0 to 15 are the general purpose registers, and 16 is the
+// return address column.
+const int n_cfi_registers = 17;
+const int cfi_return_address = 16;
+const int cfi_rsp = 7;
+const int cfi_rbp = 6;
+
+// How to recover a register of the caller, relative to the CFA.
+struct cfi_rule {
+    enum class kind {
+        undefined,
+        same_value,
+        offset,
+        val_offset,
+        reg,
+        unsupported,
+    };
+
+    kind type;
+    int64_t value;
+};
+
+// A row of the call frame table: how to compute the CFA and the caller's
+// registers at one pc. A cfa_register of -1 means the CFA is given by an
+// expression, which is not supported.
+struct cfi_row {
+    int cfa_register;
+    int64_t cfa_offset;
+    std::array<cfi_rule, n_cfi_registers> rules;
+};
+
+// The call frame information of an ELF file, from .eh_frame and
+// .debug_frame. FDEs are parsed once into a table sorted by address, and
+// the row computed for each pc is memoized, since backtraces keep
+// unwinding through the same return addresses.
+class cfi_table {
+public:
+    cfi_table(const elf::elf &elf);
+
+    // Returns the row for a file address, or null if no FDE covers it.
+    const cfi_row *find(uint64_t pc);
+
+private:
+    struct cie {
+        uint64_t code_align;
+        int64_t data_align;
+        unsigned return_address;
+        uint8_t fde_encoding;
+        std::size_t address_size;
+        // Whether FDEs have augmentation data.
+        bool has_augmentation_data;
+        const uint8_t *instructions;
+        const uint8_t *end;
+    };
+
+    struct fde {
+        uint64_t low;
+        uint64_t high;
+        std::size_t cie;
+        const uint8_t *instructions;
+        const uint8_t *end;
+        // For DW_CFA_set_loc operands relative to the section.
+        const uint8_t *section;
+        uint64_t section_address;
+    };
+
+    std::vector<cie> m_cies;
+    std::vector<fde> m_fdes;
+    std::unordered_map<uint64_t, cfi_row> m_rows;
+
+    void add_section(const elf::section &section, bool is_eh_frame);
+    bool execute(const cie &c, const fde &f, const uint8_t *cursor, const uint8_t *end,
+                 uint64_t pc, cfi_row &row, const cfi_row &initial) const;
+};
+
+uint64_t read_fixed(const uint8_t *&cursor, std::size_t size) {
+    uint64_t value = 0;
+    std::memcpy(&value, cursor, size);
+    cursor += size;
+    return value;
+}
+
+uint64_t read_uleb128(const uint8_t *&cursor) {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = *cursor++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return value;
+}
+
+int64_t read_sleb128(const uint8_t *&cursor) {
+    int64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = *cursor++;
+        value |= static_cast<int64_t>(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    if (shift < 64 && (byte & 0x40)) {
+        value |= -(int64_t {1} << shift);
+    }
+
+    return value;
+}
+
+// Reads a pointer in one of the DW_EH_PE encodings. Relative forms
+// other than pcrel are not used for code addresses.
+uint64_t read_encoded(const uint8_t *&cursor, uint8_t encoding, const uint8_t *section,
+                      uint64_t section_address) {
+    uint64_t field_address = section_address + (cursor - section);
+    uint64_t value;
+
+    switch (encoding & 0x0F) {
+        case 0x00: value = read_fixed(cursor, 8); break;
+        case 0x01: value = read_uleb128(cursor); break;
+        case 0x02: value = read_fixed(cursor, 2); break;
+        case 0x03: value = read_fixed(cursor, 4); break;
+        case 0x04: value = read_fixed(cursor, 8); break;
+        case 0x09: value = read_sleb128(cursor); break;
+        case 0x0A: value = static_cast<int16_t>(read_fixed(cursor, 2)); break;
+        case 0x0B: value = static_cast<int32_t>(read_fixed(cursor, 4)); break;
+        case 0x0C: value = read_fixed(cursor, 8); break;
+        default: throw std::invalid_argument("Unknown pointer encoding");
+    }
+
+    if ((encoding & 0x70) == 0x10) {
+        value += field_address;
+    }
+
+    return value;
+}
+
+cfi_table::cfi_table(const elf::elf &elf) {
+    for (const elf::section &section : elf.sections()) {
+        if (section.get_name() == ".eh_frame" || section.get_name() == ".debug_frame") {
+            add_section(section, section.get_name() == ".eh_frame");
+        }
+    }
+
+    std::sort(m_fdes.begin(), m_fdes.end(),
+              [](const fde &a, const fde &b) { return a.low < b.low; });
+}
+
+void cfi_table::add_section(const elf::section &section, bool is_eh_frame) {
+    const uint8_t *begin = static_cast<const uint8_t *>(section.data());
+    const uint8_t *end = begin + section.size();
+    uint64_t section_address = section.get_hdr().addr;
+    std::unordered_map<std::size_t, std::size_t> cies;
+
+    // Returns the index of the CIE at an offset, parsing it first if needed.
+    auto get_cie = [&](std::size_t offset) -> std::size_t {
+        auto it = cies.find(offset);
+
+        if (it != cies.end()) {
+            return it->second;
+        }
+
+        const uint8_t *cursor = begin + offset;
+        uint64_t length = read_fixed(cursor, 4);
+        std::size_t offset_size = 4;
+
+        if (length == 0xffffffff) {
+            length = read_fixed(cursor, 8);
+            offset_size = 8;
+        }
+
+        const uint8_t *next = cursor + length;
+        cursor += offset_size; // Skip the CIE id.
+
+        uint8_t version = *cursor++;
+        std::string augmentation = reinterpret_cast<const char *>(cursor);
+        cursor += augmentation.size() + 1;
+
+        cie c {0, 0, cfi_return_address, 0x00, 8, augmentation[0] == 'z', nullptr, next};
+
+        if (!is_eh_frame && version >= 4) {
+            c.address_size = *cursor++;
+            cursor++; // Skip the segment selector size.
+        }
+
+        c.code_align = read_uleb128(cursor);
+        c.data_align = read_sleb128(cursor);
+        c.return_address = version == 1 ? *cursor++ : read_uleb128(cursor);
+
+        if (c.has_augmentation_data) {
+            uint64_t augmentation_size = read_uleb128(cursor);
+            const uint8_t *data = cursor;
+            cursor += augmentation_size;
+
+            for (char a : augmentation.substr(1)) {
+                if (a == 'R') {
+                    c.fde_encoding = *data++;
+                } else if (a == 'L') {
+                    data++;
+                } else if (a == 'P') {
+                    uint8_t encoding = *data++;
+                    read_encoded(data, encoding & 0x7F, begin, section_address);
+                }
+            }
+        }
+
+        c.instructions = cursor;
+        m_cies.push_back(c);
+        cies.emplace(offset, m_cies.size() - 1);
+        return m_cies.size() - 1;
+    };
+
+    const uint8_t *entry = begin;
+
+    while (end - entry >= 4) {
+        const uint8_t *cursor = entry;
+        uint64_t length = read_fixed(cursor, 4);
+        std::size_t offset_size = 4;
+
+        if (length == 0) {
+            // A terminator in .eh_frame, or padding.
+            if (is_eh_frame) {
+                break;
+            }
+
+            entry = cursor;
+            continue;
+        }
+
+        if (length == 0xffffffff) {
+            length = read_fixed(cursor, 8);
+            offset_size = 8;
+        }
+
+        const uint8_t *next = cursor + length;
+
+        if (length > static_cast<uint64_t>(end - cursor)) {
+            break;
+        }
+
+        const uint8_t *id_field = cursor;
+        uint64_t id = read_fixed(cursor, offset_size);
+        uint64_t cie_id = offset_size == 4 ? 0xffffffff : ~uint64_t {0};
+        bool is_cie = is_eh_frame ? id == 0 : id == cie_id;
+
+        if (!is_cie) {
+            try {
+                std::size_t cie_offset = is_eh_frame ? id_field - id - begin : id;
+                std::size_t cie_index = get_cie(cie_offset);
+                const cie &c = m_cies[cie_index];
+                fde f {0, 0, cie_index, nullptr, next, begin, section_address};
+
+                if (is_eh_frame) {
+                    f.low = read_encoded(cursor, c.fde_encoding, begin, section_address);
+                    f.high = f.low + read_encoded(cursor, c.fde_encoding & 0x0F, begin,
+                                                  section_address);
+                } else {
+                    f.low = read_fixed(cursor, c.address_size);
+                    f.high = f.low + read_fixed(cursor, c.address_size);
+                }
+
+                if (c.has_augmentation_data) {
+                    uint64_t augmentation_size = read_uleb128(cursor);
+                    cursor += augmentation_size;
+                }
+
+                f.instructions = cursor;
+
+                if (f.low != 0 && f.high > f.low) {
+                    m_fdes.push_back(f);
+                }
+            } catch (std::invalid_argument &) {
+                // Skip entries with encodings we don't read.
+            }
+        }
+
+        entry = next;
+    }
+}
+
+const cfi_row *cfi_table::find(uint64_t pc) {
+    auto memo = m_rows.find(pc);
+
+    if (memo != m_rows.end()) {
+        return &memo->second;
+    }
+
+    auto it = std::upper_bound(m_fdes.begin(), m_fdes.end(), pc,
+                               [](uint64_t pc, const fde &f) { return pc < f.low; });
+
+    if (it == m_fdes.begin() || pc >= std::prev(it)->high) {
+        return nullptr;
+    }
+
+    const fde &f = *std::prev(it);
+    const cie &c = m_cies[f.cie];
+
+    if (c.return_address >= static_cast<unsigned>(n_cfi_registers)) {
+        return nullptr;
+    }
+
+    cfi_row initial {-1, 0, {}};
+
+    for (cfi_rule &rule : initial.rules) {
+        rule = cfi_rule {cfi_rule::kind::same_value, 0};
+    }
+
+    initial.rules[cfi_return_address] = cfi_rule {cfi_rule::kind::undefined, 0};
+
+    if (!execute(c, f, c.instructions, c.end, ~uint64_t {0}, initial, initial)) {
+        return nullptr;
+    }
+
+    cfi_row row = initial;
+
+    if (!execute(c, f, f.instructions, f.end, pc, row, initial)) {
+        return nullptr;
+    }
+
+    // A return address column other than 16 is moved to 16.
+    row.rules[cfi_return_address] = row.rules[c.return_address];
+
+    return &m_rows.emplace(pc, row).first->second;
+}
+
+// Runs call frame instructions until the location passes pc. Returns false
+// for instructions that can't be decoded.
+bool cfi_table::execute(const cie &c, const fde &f, const uint8_t *cursor, const uint8_t *end,
+                        uint64_t pc, cfi_row &row, const cfi_row &initial) const {
+    uint64_t location = f.low;
+    std::vector<cfi_row> stack;
+
+    auto set_rule = [&row](uint64_t r, cfi_rule::kind type, int64_t value) {
+        if (r < static_cast<uint64_t>(n_cfi_registers)) {
+            row.rules[r] = cfi_rule {type, value};
+        }
+    };
+
+    auto restore_rule = [&row, &initial](uint64_t r) {
+        if (r < static_cast<uint64_t>(n_cfi_registers)) {
+            row.rules[r] = initial.rules[r];
+        }
+    };
+
+    while (cursor < end) {
+        uint8_t op = *cursor++;
+        uint8_t operand = op & 0x3F;
+        uint64_t advance = 0;
+
+        switch (op >> 6) {
+            case 1:
+                advance = operand * c.code_align;
+                break;
+
+            case 2:
+                set_rule(operand, cfi_rule::kind::offset, read_uleb128(cursor) * c.data_align);
+                continue;
+
+            case 3:
+                restore_rule(operand);
+                continue;
+        }
+
+        if (op >> 6 == 0) {
+            switch (op) {
+                case 0x00: // DW_CFA_nop
+                    break;
+
+                case 0x01: { // DW_CFA_set_loc
+                    uint64_t target = read_encoded(cursor, c.fde_encoding, f.section,
+                                                   f.section_address);
+
+                    if (target > pc) {
+                        return true;
+                    }
+
+                    location = target;
+                    break;
+                }
+
+                case 0x02: advance = read_fixed(cursor, 1) * c.code_align; break;
+                case 0x03: advance = read_fixed(cursor, 2) * c.code_align; break;
+                case 0x04: advance = read_fixed(cursor, 4) * c.code_align; break;
+
+                case 0x05: { // DW_CFA_offset_extended
+                    uint64_t r = read_uleb128(cursor);
+                    set_rule(r, cfi_rule::kind::offset, read_uleb128(cursor) * c.data_align);
+                    break;
+                }
+
+                case 0x06: // DW_CFA_restore_extended
+                    restore_rule(read_uleb128(cursor));
+                    break;
+
+                case 0x07: // DW_CFA_undefined
+                    set_rule(read_uleb128(cursor), cfi_rule::kind::undefined, 0);
+                    break;
+
+                case 0x08: // DW_CFA_same_value
+                    set_rule(read_uleb128(cursor), cfi_rule::kind::same_value, 0);
+                    break;
+
+                case 0x09: { // DW_CFA_register
+                    uint64_t r = read_uleb128(cursor);
+                    uint64_t source = read_uleb128(cursor);
+
+                    // A register we don't track can't be read back when unwinding.
+                    if (source < static_cast<uint64_t>(n_cfi_registers)) {
+                        set_rule(r, cfi_rule::kind::reg, source);
+                    } else {
+                        set_rule(r, cfi_rule::kind::unsupported, 0);
+                    }
+                    break;
+                }
+
+                case 0x0A: // DW_CFA_remember_state
+                    stack.push_back(row);
+                    break;
+
+                case 0x0B: // DW_CFA_restore_state
+                    if (!stack.empty()) {
+                        row = stack.back();
+                        stack.pop_back();
+                    }
+                    break;
+
+                case 0x0C: // DW_CFA_def_cfa
+                    row.cfa_register = read_uleb128(cursor);
+                    row.cfa_offset = read_uleb128(cursor);
+                    break;
+
+                case 0x0D: // DW_CFA_def_cfa_register
+                    row.cfa_register = read_uleb128(cursor);
+                    break;
+
+                case 0x0E: // DW_CFA_def_cfa_offset
+                    row.cfa_offset = read_uleb128(cursor);
+                    break;
+
+                case 0x0F: // DW_CFA_def_cfa_expression
+                    row.cfa_register = -1;
+                    cursor += read_uleb128(cursor);
+                    break;
+
+                case 0x10:   // DW_CFA_expression
+                case 0x16: { // DW_CFA_val_expression
+                    uint64_t r = read_uleb128(cursor);
+                    set_rule(r, cfi_rule::kind::unsupported, 0);
+                    cursor += read_uleb128(cursor);
+                    break;
+                }
+
+                case 0x11: { // DW_CFA_offset_extended_sf
+                    uint64_t r = read_uleb128(cursor);
+                    set_rule(r, cfi_rule::kind::offset, read_sleb128(cursor) * c.data_align);
+                    break;
+                }
+
+                case 0x12: // DW_CFA_def_cfa_sf
+                    row.cfa_register = read_uleb128(cursor);
+                    row.cfa_offset = read_sleb128(cursor) * c.data_align;
+                    break;
+
+                case 0x13: // DW_CFA_def_cfa_offset_sf
+                    row.cfa_offset = read_sleb128(cursor) * c.data_align;
+                    break;
+
+                case 0x14: { // DW_CFA_val_offset
+                    uint64_t r = read_uleb128(cursor);
+                    set_rule(r, cfi_rule::kind::val_offset, read_uleb128(cursor) * c.data_align);
+                    break;
+                }
+
+                case 0x15: { // DW_CFA_val_offset_sf
+                    uint64_t r = read_uleb128(cursor);
+                    set_rule(r, cfi_rule::kind::val_offset, read_sleb128(cursor) * c.data_align);
+                    break;
+                }
+
+                case 0x2E: // DW_CFA_GNU_args_size
+                    read_uleb128(cursor);
+                    break;
+
+                case 0x2F: { // DW_CFA_GNU_negative_offset_extended
+                    uint64_t r = read_uleb128(cursor);
+                    set_rule(r, cfi_rule::kind::offset, -(read_uleb128(cursor) * c.data_align));
+                    break;
+                }
+
+                default:
+                    return false;
+            }
+        }
+
+        if (advance) {
+            if (location + advance > pc) {
+                return true;
+            }
+
+            location += advance;
+        }
+    }
+
+    return true;
+}
+
+class symbolizer;
+
+// An ELF file mapped into the tracee. Its debug information and symbols
+// are only loaded the first time they are needed, since most of the
+// shared libraries of a process are never looked at. DWARF and symbol
+// addresses are file addresses, which are offset by the load bias at
+// runtime.
+class module {
+public:
+    module(const std::string &path, uint64_t bias);
+    module(const module &) = delete;
+    module &operator=(const module &) = delete;
+    ~module();
+
+    const std::string &get_path() const {
+        return m_path;
+    }
+
+    uint64_t get_bias() const {
+        return m_bias;
+    }
+
+    void set_bias(uint64_t bias) {
+        m_bias = bias;
+    }
+
+    const elf::elf &get_elf() const {
+        return m_elf;
+    }
+
+    // Whether a runtime address lies in one of the loadable segments.
+    bool contains(uint64_t address) const;
+
+    // Whether the file has debug information, which is loaded on first use.
+    bool has_dwarf();
+
+    // Returns null if the file has no debug information.
+    dwarf_index *get_index();
+    const dwarf::dwarf &get_dwarf();
+    const name_index<symbol> &get_symbols();
+    cfi_table &get_cfi();
+    const symbolizer &get_symbolizer();
+
+    // Returns the name of the function symbol covering a file address, or
+    // an empty string if there is none.
+    const std::string &get_function_symbol(uint64_t address);
+
+private:
+    std::string m_path;
+    uint64_t m_bias;
+    elf::elf m_elf;
+    std::vector<std::pair<uint64_t, uint64_t>> m_segments;
+    bool m_dwarf_loaded;
+    bool m_has_dwarf;
+    dwarf::dwarf m_dwarf;
+    std::unique_ptr<dwarf_index> m_index;
+    name_index<symbol> m_symbols;
+    bool m_symbols_built;
+    std::unique_ptr<cfi_table> m_cfi;
+    std::unique_ptr<symbolizer> m_symbolizer;
+
+    struct function_symbol {
+        uint64_t low;
+        uint64_t high;
+        std::string name;
+    };
+
+    // Sorted by address.
+    std::vector<function_symbol> m_function_symbols;
+};
+
+module::module(const std::string &path, uint64_t bias)
+    : m_path{path}, m_bias{bias}, m_dwarf_loaded{false}, m_has_dwarf{false},
+      m_symbols_built{false} {
+    int fd = open(m_path.c_str(), O_RDONLY);
+
+    if (fd == -1) {
+        throw std::runtime_error("Cannot open " + m_path);
+    }
+
+    m_elf = elf::elf {elf::create_mmap_loader(fd)};
+
+    for (const elf::segment &segment : m_elf.segments()) {
+        const elf::Phdr<> &hdr = segment.get_hdr();
+
+        if (hdr.type == elf::pt::load) {
+            m_segments.emplace_back(hdr.vaddr, hdr.vaddr + hdr.memsz);
+        }
+    }
+}
+
+bool module::contains(uint64_t address) const {
+    for (const auto &segment : m_segments) {
+        if (address >= segment.first + m_bias && address < segment.second + m_bias) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool module::has_dwarf() {
+    if (!m_dwarf_loaded) {
+        m_dwarf_loaded = true;
+
+        try {
+            m_dwarf = dwarf::dwarf {dwarf::elf::create_loader(m_elf)};
+            m_has_dwarf = true;
+        } catch (std::exception &) {
+            // No debug information; only symbols are available.
+        }
+    }
+
+    return m_has_dwarf;
+}
+
+dwarf_index *module::get_index() {
+    if (!m_index && has_dwarf()) {
+        try {
+            m_index.reset(new dwarf_index {m_elf, m_dwarf, m_path});
+        } catch (std::exception &) {
+            m_has_dwarf = false;
+        }
+    }
+
+    return m_index.get();
+}
+
+const dwarf::dwarf &module::get_dwarf() {
+    has_dwarf();
+    return m_dwarf;
+}
+
+const name_index<symbol> &module::get_symbols() {
+    if (!m_symbols_built) {
+        for (const elf::section &section : m_elf.sections()) {
+            elf::sht type = section.get_hdr().type;
+
+            if (type != elf::sht::symtab && type != elf::sht::dynsym) {
+                continue;
+            }
+
+            for (elf::sym sym : section.as_symtab()) {
+                const elf::Sym<> &data = sym.get_data();
+                symbol_type st = to_symbol_type(data.type());
+                std::string name = sym.get_name();
+                m_symbols.add(name, symbol {st, name, data.value});
+
+                if (st == symbol_type::func && data.value && data.size) {
+                    m_function_symbols.push_back(
+                        function_symbol {data.value, data.value + data.size, name});
+                }
+            }
+        }
+
+        std::sort(m_function_symbols.begin(), m_function_symbols.end(),
+                  [](const function_symbol &a, const function_symbol &b) {
+                      return a.low < b.low;
+                  });
+
+        m_symbols.finalize();
+        m_symbols_built = true;
+    }
+
+    return m_symbols;
+}
+
+const std::string &module::get_function_symbol(uint64_t address) {
+    static const std::string none;
+
+    get_symbols();
+
+    auto it = std::upper_bound(
+        m_function_symbols.begin(), m_function_symbols.end(), address,
+        [](uint64_t address, const function_symbol &sym) { return address < sym.low; });
+
+    if (it == m_function_symbols.begin() || address >= std::prev(it)->high) {
+        return none;
+    }
+
+    return std::prev(it)->name;
+}
+
+cfi_table &module::get_cfi() {
+    if (!m_cfi) {
+        m_cfi.reset(new cfi_table {m_elf});
+    }
+
+    return *m_cfi;
+}
+
+// Maps file addresses of a module to source locations, with a frame for
+// each inlined call. Everything is read from DWARF up front into sorted
+// arrays, so lookups don't touch libelfin and can run on many threads at
+// once. Code without DWARF is named from the symbol table.
+class symbolizer {
+public:
+    struct frame {
+        const std::string *function;
+        const std::string *file;
+        unsigned line;
+    };
+
+    explicit symbolizer(module &m);
+    symbolizer(const symbolizer &) = delete;
+    symbolizer &operator=(const symbolizer &) = delete;
+
+    // Appends the frames covering a file address to frames, innermost
+    // first. Unknown names and files are empty, and unknown lines are 0.
+    void symbolize(uint64_t address, std::vector<frame> &frames) const;
+
+private:
+    // Laid out like function_index. The call site is where an inlined
+    // function was called from, in its parent.
+    struct function {
+        uint64_t low;
+        uint64_t high;
+        std::ptrdiff_t parent;
+        bool inlined;
+        uint32_t name;
+        uint32_t call_file;
+        unsigned call_line;
+    };
+
+    // Sorted by address. A row at the end of a sequence covers nothing.
+    struct line_row {
+        uint64_t address;
+        bool end_sequence;
+        uint32_t file;
+        unsigned line;
+    };
+
+    module &m_module;
+    std::vector<std::string> m_strings;
+    std::vector<function> m_functions;
+    std::vector<line_row> m_lines;
+};
+
+symbolizer::symbolizer(module &m) : m_module{m} {
+    std::unordered_map<std::string, uint32_t> ids;
+
+    auto intern = [&](const std::string &string) {
+        auto it = ids.emplace(string, m_strings.size());
+
+        if (it.second) {
+            m_strings.push_back(string);
+        }
+
+        return it.first->second;
+    };
+
+    intern("");
+    m.get_symbols();
+
+    if (!m.has_dwarf()) {
+        return;
+    }
+
+    function_index functions;
+    std::unordered_map<const dwarf::unit *, const dwarf::line_table *> line_tables;
+
+    for (const dwarf::compilation_unit &cu : m.get_dwarf().compilation_units()) {
+        functions.add(cu);
+
+        try {
+            const dwarf::line_table &lt = cu.get_line_table();
+            line_tables.emplace(&cu, &lt);
+
+            for (const dwarf::line_table::entry &entry : lt) {
+                m_lines.push_back(line_row {entry.address, entry.end_sequence,
+                                            entry.end_sequence ? 0 : intern(entry.file->path),
+                                            entry.line});
+            }
+        } catch (std::exception &) {
+            // A unit without a line table only has function names.
+        }
+    }
+
+    functions.finalize();
+
+    for (const function_index::entry &e : functions.get_entries()) {
+        function f {e.low, e.high, e.parent, e.die.tag == dwarf::DW_TAG::inlined_subroutine,
+                    intern(get_function_name(e.die)), 0, 0};
+
+        if (f.inlined) {
+            auto it = line_tables.find(&e.die.get_unit());
+
+            try {
+                if (it != line_tables.end() && e.die.has(dwarf::DW_AT::call_file)) {
+                    unsigned index = e.die[dwarf::DW_AT::call_file].as_uconstant();
+                    f.call_file = intern(it->second->get_file(index)->path);
+                }
+
+                if (e.die.has(dwarf::DW_AT::call_line)) {
+                    f.call_line = e.die[dwarf::DW_AT::call_line].as_uconstant();
+                }
+            } catch (std::exception &) {
+            }
+        }
+
+        m_functions.push_back(f);
+    }
+
+    // Where one sequence ends at the start of another, the start wins.
+    std::stable_sort(m_lines.begin(), m_lines.end(), [](const line_row &a, const line_row &b) {
+        if (a.address != b.address) {
+            return a.address < b.address;
+        }
+
+        return a.end_sequence && !b.end_sequence;
+    });
+}
+
+void symbolizer::symbolize(uint64_t address, std::vector<frame> &frames) const {
+    const std::string *file = &m_strings[0];
+    unsigned line = 0;
+
+    auto row = std::upper_bound(
+        m_lines.begin(), m_lines.end(), address,
+        [](uint64_t address, const line_row &row) { return address < row.address; });
+
+    if (row != m_lines.begin() && !std::prev(row)->end_sequence) {
+        file = &m_strings[std::prev(row)->file];
+        line = std::prev(row)->line;
+    }
+
+    auto it = std::upper_bound(
+        m_functions.begin(), m_functions.end(), address,
+        [](uint64_t address, const function &f) { return address < f.low; });
+    std::ptrdiff_t i = (it - m_functions.begin()) - 1;
+    std::size_t n_frames = frames.size();
+
+    while (i >= 0) {
+        const function &f = m_functions[i];
+
+        if (address < f.high) {
+            frames.push_back(frame {&m_strings[f.name], file, line});
+
+            if (!f.inlined) {
+                break;
+            }
+
+            file = &m_strings[f.call_file];
+            line = f.call_line;
+        }
+
+        i = f.parent;
+    }
+
+    if (frames.size() == n_frames) {
+        frames.push_back(frame {&m_module.get_function_symbol(address), file, line});
+    }
+}
+
+module::~module() {}
+
+const symbolizer &module::get_symbolizer() {
+    if (!m_symbolizer) {
+        m_symbolizer.reset(new symbolizer {*this});
+    }
+
+    return *m_symbolizer;
+}
+
+// Names the frames at a runtime address of m for reports, innermost first:
+// the functions inlined there and the one they were inlined into, from
+// DWARF or the symbol table, or else the module and offset.
+std::vector<std::string> get_report_frames(module &m, uint64_t address) {
+    std::vector<symbolizer::frame> frames;
+    m.get_symbolizer().symbolize(address - m.get_bias(), frames);
+
+    std::vector<std::string> names;
+
+    for (const symbolizer::frame &frame : frames) {
+        if (!frame.function->empty()) {
+            names.push_back(*frame.function);
+        }
+    }
+
+    if (!names.empty()) {
+        return names;
+    }
+
+    std::stringstream stream;
+    stream << m.get_path().substr(m.get_path().rfind('/') + 1) << "+0x" << std::hex
+           << address - m.get_bias();
+    return {stream.str()};
+}
+
+// A frame found while unwinding, with the registers recovered for it by
+// DWARF number. Bit n of valid is set if register n was recovered.
+struct unwind_frame {
+    uint64_t pc;
+    std::array<uint64_t, n_cfi_registers> regs;
+    uint32_t valid;
+};
+
+// Replaces frame with its caller, using the CFI of m, the module
+// containing its pc, or the frame pointer where there is none. m can be
+// null. Memory is read with read(address, value), which returns false if
+// the address can't be read. Returns false at the outermost frame, or
+// when the caller can't be recovered.
+template <typename Read>
+bool unwind_caller(unwind_frame &frame, bool innermost, module *m, Read read) {
+    auto is_valid = [&frame](int r) { return (frame.valid >> r) & 1; };
+
+    const cfi_row *row = nullptr;
+
+    if (m) {
+        uint64_t pc = innermost ? frame.pc : frame.pc - 1;
+        row = m->get_cfi().find(pc - m->get_bias());
+    }
+
+    unwind_frame caller {0, frame.regs, 0};
+    uint64_t cfa;
+
+    if (row && row->cfa_register >= 0 && is_valid(row->cfa_register)) {
+        cfa = frame.regs[row->cfa_register] + row->cfa_offset;
+
+        for (int r = 0; r < n_cfi_registers; r++) {
+            const cfi_rule &rule = row->rules[r];
+
+            switch (rule.type) {
+                case cfi_rule::kind::same_value:
+                    caller.valid |= frame.valid & (1u << r);
+                    break;
+
+                case cfi_rule::kind::offset:
+                    if (read(cfa + rule.value, caller.regs[r])) {
+                        caller.valid |= 1u << r;
+                    }
+                    break;
+
+                case cfi_rule::kind::val_offset:
+                    caller.regs[r] = cfa + rule.value;
+                    caller.valid |= 1u << r;
+                    break;
+
+                case cfi_rule::kind::reg:
+                    if (is_valid(rule.value)) {
+                        caller.regs[r] = frame.regs[rule.value];
+                        caller.valid |= 1u << r;
+                    }
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    } else if (!row && is_valid(cfi_rbp) && frame.regs[cfi_rbp]) {
+        uint64_t frame_pointer = frame.regs[cfi_rbp];
+        cfa = frame_pointer + 2 * sizeof(uint64_t);
+
+        if (!read(frame_pointer + sizeof(uint64_t), caller.regs[cfi_return_address]) ||
+            !read(frame_pointer, caller.regs[cfi_rbp])) {
+            return false;
+        }
+
+        caller.valid = frame.valid | (1u << cfi_return_address);
+    } else {
+        return false;
+    }
+
+    caller.regs[cfi_rsp] = cfa;
+    caller.valid |= 1u << cfi_rsp;
+
+    // The stack only grows one way, so this also stops loops.
+    if (!((caller.valid >> cfi_return_address) & 1) || caller.regs[cfi_return_address] == 0 ||
+        (is_valid(cfi_rsp) && cfa <= frame.regs[cfi_rsp])) {
+        return false;
+    }
+
+    caller.pc = caller.regs[cfi_return_address];
+    frame = caller;
+    return true;
+}
+
+// Writes sampled stacks, innermost frame first, as folded stacks to output,
+// and the top_n functions with the most samples to standard output. Frames
+// are named with name(pc, innermost), once per address, which returns the
+// names of the inlined functions there too, innermost first.
+template <typename Namer>
+void write_profile(const std::map<std::vector<uint64_t>, uint64_t> &samples, uint64_t n_samples,
+                   std::size_t top_n, const std::string &output, Namer name) {
+    // Self and total samples per function, counting each function once
+    // per stack for the total.
+    std::unordered_map<uint64_t, std::vector<std::string>> names;
+    std::unordered_map<std::string, std::pair<uint64_t, uint64_t>> functions;
+    std::ofstream folded {output};
+
+    for (const auto &sample : samples) {
+        const std::vector<uint64_t> &stack = sample.first;
+        std::vector<std::string> frames;
+
+        for (std::size_t i = 0; i < stack.size(); i++) {
+            auto it = names.find(stack[i]);
+
+            if (it == names.end()) {
+                it = names.emplace(stack[i], name(stack[i], i == 0)).first;
+            }
+
+            frames.insert(frames.end(), it->second.begin(), it->second.end());
+        }
+
+        functions[frames.front()].first += sample.second;
+        std::unordered_set<std::string> seen;
+
+        for (const std::string &frame : frames) {
+            if (seen.insert(frame).second) {
+                functions[frame].second += sample.second;
+            }
+        }
+
+        for (std::size_t i = frames.size(); i-- > 0;) {
+            folded << frames[i] << (i > 0 ? ";" : "");
+        }
+
+        folded << ' ' << sample.second << '\n';
+    }
+
+    std::vector<std::pair<std::string, std::pair<uint64_t, uint64_t>>> table {functions.begin(),
+                                                                             functions.end()};
+    std::sort(table.begin(), table.end(), [](auto &&a, auto &&b) {
+        return a.second.first > b.second.first;
+    });
+
+    std::cout << std::dec << n_samples << " samples written to " << output << std::endl;
+    std::cout << std::setw(8) << "self" << std::setw(8) << "total" << "  function" << std::endl;
+
+    for (std::size_t i = 0; i < table.size() && i < top_n; i++) {
+        std::cout << std::fixed << std::setprecision(1)
+                  << std::setw(7) << 100.0 * table[i].second.first / n_samples << '%'
+                  << std::setw(7) << 100.0 * table[i].second.second / n_samples << '%'
+                  << "  " << table[i].first << std::endl;
+    }
+}
+
+const std::size_t max_trace_records = 1 << 16;
+const std::size_t trampolines_size = 1 << 16;
+// Each thread steps displaced instructions in its own slot of the scratch
+// page, so that threads running in non-stop mode don't overwrite them.
+const std::size_t scratch_slot_size = 32;
+// Steps of a repeated string instruction to run displaced before finishing
+// it in place.
+const std::size_t max_displaced_steps = 256;
+
+// A tracepoint whose site jumps to a trampoline that logs into the trace
+// ring, without stopping the tracee.
+struct fast_tracepoint {
+    std::vector<uint8_t> original;
+    std::shared_ptr<const tracepoint_format> format;
+    uint64_t hit_count;
+};
+
+// A one-shot breakpoint for coverage, which counts a hit for its line and
+// is removed.
+struct coverage_site {
+    uint64_t *hit_count;
+    bool removed;
+};
+
+// A thread of the tracee and the state of its last stop.
+struct tracee_thread {
+    tracee_thread(pid_t tid)
+        : registers{tid}, running{true}, starting{false}, stop_requested{false},
+          resume_request{PTRACE_CONT}, has_pending_status{false}, pending_status{0},
+          scratch{0} {}
+
+    register_cache registers;
+    bool running;
+    // Created by a clone, but its first stop has not been seen yet.
+    bool starting;
+    // Sent a SIGSTOP that has not been seen yet.
+    bool stop_requested;
+    // How the thread was last resumed, to resume it the same way after
+    // stops the user never sees.
+    __ptrace_request resume_request;
+    // A stop that happened while stopping all threads, to be reported
+    // before anything is resumed. For the main thread, this can also be
+    // the exit of the process.
+    bool has_pending_status;
+    int pending_status;
+    // The thread's slot for displaced steps, or 0 if it has none yet.
+    uint64_t scratch;
+};
+
+class debugger {
+public:
+    debugger(std::string prog_name, pid_t pid)
+        : m_prog_name{std::move(prog_name)}, m_pid{pid}, m_tid{pid}, m_registers{nullptr},
+          m_all_stop{true}, m_attached{false}, m_detached{false}, m_memory{pid},
+          m_breakpoint_sites{m_memory}, m_debug_registers{pid}, m_block_step{true},
+          m_auto_resume{false}, m_trace_ring_address{0}, m_trampolines{0},
+          m_trampolines_used{0}, m_scratch{0}, m_scratch_mapped{false}, m_loader_breakpoint{0},
+          m_r_debug{0} {
+        // The executable is indexed right away; its load bias is only
+        // known once it has been exec'd.
+        m_modules.emplace_back(new module {m_prog_name, 0});
+        m_modules.front()->get_index();
+
+        m_registers = &m_threads.emplace(pid, pid).first->second.registers;
+    }
+
+    void attach();
+    void run();
+    void profile(unsigned hz, std::size_t top_n, const std::string &output);
+    void coverage(const std::vector<std::string> &sources, const std::string &output);
+
+private:
+    std::string m_prog_name;
+    pid_t m_pid;
+    pid_t m_tid;
+    std::map<pid_t, tracee_thread> m_threads;
+    register_cache *m_registers;
+    bool m_all_stop;
+    bool m_attached;
+    bool m_detached;
+    tracee_memory m_memory;
+    breakpoint_sites m_breakpoint_sites;
+    std::unordered_map<std::intptr_t, breakpoint> m_breakpoints;
+    // Breakpoints planted by a stepping command, which stops at them
+    // without reporting them.
+    std::unordered_set<uint64_t> m_step_breakpoints;
+    debug_registers m_debug_registers;
+    // Cleared when the kernel turns down PTRACE_SINGLEBLOCK.
+    bool m_block_step;
+    bool m_auto_resume;
+    std::deque<std::string> m_trace_log;
+    std::map<uint64_t, fast_tracepoint> m_fast_tracepoints;
+    std::unique_ptr<trace_ring> m_trace_ring;
+    uint64_t m_trace_ring_address;
+    uint64_t m_trampolines;
+    std::size_t m_trampolines_used;
+    uint64_t m_scratch;
+    bool m_scratch_mapped;
+    // The executable comes first, followed by the shared objects in the
+    // dynamic linker's order.
+    std::vector<std::unique_ptr<module>> m_modules;
+    uint64_t m_loader_breakpoint;
+    uint64_t m_r_debug;
+
+    void handle_command(const std::string &line);
+    void require_process() const;
+    void update_memory_caching();
+    void clear_threads();
+    void invalidate_caches();
+    void continue_execution();
+    void set_breakpoint_at_address(std::intptr_t address);
+    std::vector<uint64_t> get_breakpoint_addresses(const std::string &location);
+    std::vector<uint64_t> get_function_breakpoint_addresses(const std::string &name);
+    std::vector<uint64_t> get_line_breakpoint_addresses(const std::string &file, unsigned line);
+    void set_hardware_breakpoint(const std::string &location);
+    void set_watchpoint(const std::string &target, debug_condition condition, std::size_t size);
+    void remove_debug_slot(int slot, bool execute);
+    bool get_variable_location(const std::string &name, uint64_t &address, std::size_t &size);
+    void remove_breakpoint(std::intptr_t address);
+    void set_tracepoint(const std::string &location, const std::string &format);
+    void print_breakpoints();
+    void print_trace_log();
+    void set_fast_tracepoint(const std::string &location, const std::string &format);
+    void check_displaced_range(uint64_t low, uint64_t high);
+    std::map<uint64_t, fast_tracepoint>::const_iterator
+    find_fast_tracepoint(uint64_t address) const;
+    void start_trace_agent(uint64_t near);
+    void collect_fast_trace_records();
+    uint64_t inject_syscall(long number, std::initializer_list<uint64_t> args);
+    uint64_t map_near(uint64_t near, std::size_t size);
+    void dump_registers();
+    void dump_memory(uint64_t address, std::size_t size);
+    uint64_t read_memory(uint64_t address);
+    void read_memory(uint64_t address, uint8_t *data, std::size_t size);
+    void write_memory(uint64_t address, uint64_t value);
+    uint64_t get_pc();
+    void set_pc(uint64_t pc);
+    void step_single_instruction();
+    void step_single_instruction_with_breakpoint_check();
+    void step_block();
+    void step_over_breakpoint();
+    bool step_displaced();
+    void read_code(uint64_t address, uint8_t *code, std::size_t size);
+    bool has_line_entry(uint64_t pc);
+    void set_step_breakpoints(const std::unordered_set<uint64_t> &addresses);
+    void remove_step_breakpoints();
+    bool run_to(const std::unordered_set<uint64_t> &addresses);
+    void step_line(bool into_calls);
+    uint64_t get_frame_cfa();
+    bool is_below_frame(uint64_t cfa);
+    void step_in();
+    void step_over();
+    void step_out();
+    void wait_for_signal(pid_t tid = -1);
+    bool handle_thread_event(pid_t tid, int status);
+    bool resume_thread(pid_t tid, __ptrace_request request, int signal = 0);
+    void stop_all_threads();
+    void step_over_thread_breakpoints();
+    void select_thread(pid_t tid);
+    void print_threads();
+    void detach();
+    void start();
+    int handle_profile_stop(pid_t tid, int status);
+    int handle_coverage_stop(pid_t tid, int status,
+                             std::unordered_map<uint64_t, coverage_site> &sites);
+    std::vector<std::string> get_frame_names(uint64_t pc, bool innermost);
+    dwarf::die get_function_from_pc(uint64_t pc);
+    dwarf::line_table::iterator get_line_entry_from_pc(uint64_t pc);
+    void print_source(const std::string &filename, unsigned line, unsigned n_lines_context = 2);
+    void print_backtrace();
+    unwind_frame get_innermost_frame();
+    bool unwind(unwind_frame &frame, bool innermost);
+    siginfo_t get_signal_info();
+    void handle_sigtrap(siginfo_t info);
+    std::vector<symbol> lookup_symbol(const std::string &name);
+    module &get_module(uint64_t address);
+    uint64_t get_auxv(uint64_t type);
+    std::string read_string(uint64_t address);
+    void load_modules();
+    void update_modules();
+    void drop_breakpoints(const module &m);
+    void read_variables();
+};
+
+// Seizes every thread of a running process without stopping it, so that
+// it keeps running while the ELF file is loaded and indexed. Threads that
+// start while this runs are either seized on the next pass over the task
+// directory or, if a seized thread created them, traced automatically.
+void debugger::attach() {
+    const long options = PTRACE_O_TRACECLONE;
+
+    if (ptrace(PTRACE_SEIZE, m_pid, nullptr, options) == -1) {
+        throw std::runtime_error("Cannot attach to " + std::to_string(m_pid) + ": " +
+                                 strerror(errno));
+    }
+
+    m_attached = true;
+    std::string task_path = "/proc/" + std::to_string(m_pid) + "/task";
+    bool found_new = true;
+
+    while (found_new) {
+        found_new = false;
+        DIR *dir = opendir(task_path.c_str());
+
+        if (!dir) {
+            break;
+        }
+
+        while (dirent *entry = readdir(dir)) {
+            if (!std::isdigit(entry->d_name[0])) {
+                continue;
+            }
+
+            pid_t tid = std::stoi(entry->d_name);
+
+            if (m_threads.count(tid)) {
+                continue;
+            }
+
+            if (ptrace(PTRACE_SEIZE, tid, nullptr, options) == 0) {
+                m_threads.emplace(tid, tid);
+                m_debug_registers.add_thread(tid);
+                found_new = true;
+            }
+        }
+
+        closedir(dir);
+    }
+}
+
+// Waits for the first stop of the tracee and finds its modules.
+void debugger::start() {
+    if (m_attached) {
+        stop_all_threads();
+        std::cout << "Attached to process " << std::dec << m_pid << " with "
+                  << m_threads.size() << " threads" << std::endl;
+    } else {
+        wait_for_signal();
+        ptrace(PTRACE_SETOPTIONS, m_pid, nullptr, PTRACE_O_TRACECLONE);
+    }
+
+    load_modules();
+}
+
+void debugger::run() {
+    start();
+
+    char *line = nullptr;
+    while (!m_detached && (line = linenoise("dbg> ")) != nullptr) {
+        try {
+            handle_command(line);
+        } catch (std::exception &e) {
+            std::cerr << e.what() << std::endl;
+        }
+
+        linenoiseHistoryAdd(line);
+        linenoiseFree(line);
+    }
+
+    // Leaving int3 bytes behind would crash a process we didn't start.
+    if (m_attached && !m_detached && !m_threads.empty()) {
+        detach();
+    }
+}
+
+void debugger::handle_command(const std::string &line) {
+    std::vector<std::string> args = split(line, ' ');
+    std::string command = args[0];
+
+    if (is_prefix(command, "continue")) {
+        require_process();
+        continue_execution();
+    } else if (is_prefix(command, "detach")) {
+        require_process();
+        detach();
+    } else if (is_prefix(command, "thread")) {
+        require_process();
+        if (is_prefix(args[1], "list")) {
+            print_threads();
+        } else if (is_prefix(args[1], "select")) {
+            select_thread(std::stoi(args[2]));
+        } else if (is_prefix(args[1], "mode")) {
+            if (args[2] == "all-stop") {
+                m_all_stop = true;
+                stop_all_threads();
+            } else if (args[2] == "non-stop") {
+                // Threads stop on their own, and continue only resumes the
+                // selected one; the others stay as they are.
+                m_all_stop = false;
+            } else {
+                throw std::invalid_argument("Unknown mode " + args[2]);
+            }
+        }
+    } else if (is_prefix(command, "breakpoint")) {
+        require_process();
+        std::string condition;
+
+        if (args.size() > 3 && args[2] == "if") {
+            for (std::size_t i = 3; i < args.size(); i++) {
+                condition += args[i] + ' ';
+            }
+        }
+
+        for (uint64_t address : get_breakpoint_addresses(args[1])) {
+            // The condition is compiled first, so that one that doesn't
+            // compile leaves no breakpoint behind.
+            std::shared_ptr<breakpoint_expression> expression;
+
+            if (!condition.empty()) {
+                dwarf::die func = get_function_from_pc(address);
+                uint64_t bias = get_module(address).get_bias();
+                expression = std::make_shared<breakpoint_expression>(condition, func, bias);
+            }
+
+            set_breakpoint_at_address(address);
+
+            if (expression) {
+                m_breakpoints.at(address).set_condition(expression);
+            }
+        }
+    } else if (is_prefix(command, "tracepoint")) {
+        require_process();
+        std::string format;
+
+        for (std::size_t i = 2; i < args.size(); i++) {
+            format += (i > 2 ? " " : "") + args[i];
+        }
+
+        set_tracepoint(args[1], format);
+    } else if (is_prefix(command, "ftrace")) {
+        require_process();
+        std::string format;
+
+        for (std::size_t i = 2; i < args.size(); i++) {
+            format += (i > 2 ? " " : "") + args[i];
+        }
+
+        set_fast_tracepoint(args[1], format);
+    } else if (is_prefix(command, "ignore")) {
+        uint64_t address = std::stoul(args[1], nullptr, 16);
+        m_breakpoints.at(address).set_ignore_count(std::stoul(args[2]));
+    } else if (is_prefix(command, "info")) {
+        print_breakpoints();
+    } else if (is_prefix(command, "log")) {
+        if (args.size() > 1 && is_prefix(args[1], "clear")) {
+            m_trace_log.clear();
+        } else {
+            print_trace_log();
+        }
+    } else if (is_prefix(command, "hbreak")) {
+        require_process();
+        if (args[1] == "delete" && args.size() > 2) {
+            remove_debug_slot(std::stoi(args[2]), true);
+        } else {
+            set_hardware_breakpoint(args[1]);
+        }
+    } else if (is_prefix(command, "watch")) {
+        require_process();
+        if (args[1] == "delete" && args.size() > 2) {
+            remove_debug_slot(std::stoi(args[2]), false);
+            return;
+        }
+
+        // Debug registers cannot trap on reads alone, so "r" watches both.
+        debug_condition condition = debug_condition::write;
+
+        if (args.size() > 2 && (args[2] == "r" || args[2] == "rw")) {
+            condition = debug_condition::read_write;
+        } else if (args.size() > 2 && args[2] != "w") {
+            throw std::invalid_argument("Unknown access mode " + args[2]);
+        }
+
+        std::size_t size = args.size() > 3 ? std::stoul(args[3], nullptr, 0) : 0;
+        set_watchpoint(args[1], condition, size);
+    } else if (is_prefix(command, "register")) {
+        require_process();
+        if (is_prefix(args[1], "dump")) {
+            dump_registers();
+        } else if (is_prefix(args[1], "read")) {
+            reg reg = get_register_from_name(args[2]);
+            std::cout << m_registers->get(reg) << std::endl;
         } else if (is_prefix(args[1], "write")) {
             reg reg = get_register_from_name(args[2]);
             std::string str {args[3], 2};
             uint64_t value = std::stol(str, nullptr, 16);
-            set_register_value(m_pid, reg, value);
+            m_registers->set(reg, value);
+        }
+    } else if (is_prefix(command, "memory")) {
+        if (is_prefix(args[1], "stats")) {
+            std::cout << std::dec << "Page cache hits: " << m_memory.get_hits()
+                      << ", misses: " << m_memory.get_misses() << std::endl;
+            return;
+        }
+
+        require_process();
+        std::string str {args[2], 2};
+        uint64_t address = std::stol(str, nullptr, 16);
+
+        if (is_prefix(args[1], "read")) {
+            if (args.size() > 3) {
+                dump_memory(address, std::stoul(args[3], nullptr, 0));
+            } else {
+                std::cout << std::hex << read_memory(address) << std::endl;
+            }
+        } else if (is_prefix(args[1], "write")) {
+            std::string str {args[3], 2};
+            uint64_t value = std::stol(str, nullptr, 16);
+            write_memory(address, value);
+        }
+    } else if (is_prefix(command, "step")) {
+        require_process();
+        step_in();
+    } else if (is_prefix(command, "stepi")) {
+        require_process();
+        step_single_instruction_with_breakpoint_check();
+        dwarf::line_table::iterator line_entry = get_line_entry_from_pc(get_pc());
+        print_source(line_entry->file->path, line_entry->line);
+    } else if (is_prefix(command, "next")) {
+        require_process();
+        step_over();
+    } else if (is_prefix(command, "finish")) {
+        require_process();
+        step_out();
+    } else if (is_prefix(command, "symbol")) {
+        std::vector<symbol> symbols = lookup_symbol(args[1]);
+
+        for (symbol &sym : symbols) {
+            std::cout << sym.name << ' ' << to_string(sym.type)
+                      << " 0x" << std::hex << sym.address << std::endl;
+        }
+    } else if (is_prefix(command, "backtrace")) {
+        require_process();
+        print_backtrace();
+    } else if (is_prefix(command, "variables")) {
+        require_process();
+        read_variables();
+    } else {
+        std::cerr << "Unknown command" << std::endl;
+    }
+}
+
+// Throws if the tracee has exited, for commands that need its registers
+// or memory.
+void debugger::require_process() const {
+    if (m_threads.empty()) {
+        throw std::runtime_error("The program is not being run");
+    }
+}
+
+// Forgets the threads of a process that has exited or been let go.
+void debugger::clear_threads() {
+    m_threads.clear();
+    m_registers = nullptr;
+}
+
+void debugger::invalidate_caches() {
+    for (auto &entry : m_threads) {
+        entry.second.registers.invalidate();
+    }
+
+    m_memory.flush();
+}
+
+// In all-stop mode every thread is resumed, unless one has a stop that
+// hasn't been reported yet, in which case that stop is reported without
+// resuming anything. In non-stop mode only the selected thread runs.
+void debugger::continue_execution() {
+    do {
+        bool pending = false;
+
+        for (const auto &entry : m_threads) {
+            pending |= entry.second.has_pending_status;
+        }
+
+        if (!pending) {
+            step_over_thread_breakpoints();
+            invalidate_caches();
+
+            if (m_all_stop) {
+                for (const auto &entry : m_threads) {
+                    if (!entry.second.running) {
+                        resume_thread(entry.first, PTRACE_CONT);
+                    }
+                }
+            } else {
+                resume_thread(m_tid, PTRACE_CONT);
+            }
+        }
+
+        wait_for_signal();
+    } while (m_auto_resume);
+}
+
+// Gets threads other than the selected one past the breakpoints they
+// stopped at, which they would otherwise hit again when resumed.
+void debugger::step_over_thread_breakpoints() {
+    pid_t selected = m_tid;
+
+    for (const auto &entry : m_threads) {
+        const tracee_thread &t = entry.second;
+
+        if (entry.first == selected || t.running || t.has_pending_status) {
+            continue;
+        }
+
+        m_tid = entry.first;
+        m_registers = &m_threads.at(m_tid).registers;
+        step_over_breakpoint();
+    }
+
+    m_tid = selected;
+    m_registers = &m_threads.at(m_tid).registers;
+    step_over_breakpoint();
+}
+
+// Returns false if ptrace refused the request, in which case the thread
+// stays stopped.
+bool debugger::resume_thread(pid_t tid, __ptrace_request request, int signal) {
+    m_breakpoint_sites.apply();
+
+    tracee_thread &t = m_threads.at(tid);
+    t.registers.invalidate();
+    t.resume_request = request;
+    t.running = true;
+
+    void *data = reinterpret_cast<void *>(static_cast<intptr_t>(signal));
+
+    if (ptrace(request, tid, nullptr, data) == -1) {
+        t.running = false;
+        return false;
+    }
+
+    m_memory.set_cached(false);
+    return true;
+}
+
+// Tracee memory can only be cached while no thread runs, which in non-stop
+// mode may not be the case after a stop.
+void debugger::update_memory_caching() {
+    bool running = false;
+
+    for (const auto &entry : m_threads) {
+        running |= entry.second.running;
+    }
+
+    m_memory.set_cached(!running);
+}
+
+// Sends SIGSTOP to every running thread before waiting for any of them,
+// so stopping many threads costs one round trip rather than one each.
+// Threads that stop for another reason first keep that stop as pending.
+void debugger::stop_all_threads() {
+    std::size_t n_running = 0;
+
+    for (auto &entry : m_threads) {
+        tracee_thread &t = entry.second;
+
+        if (!t.running) {
+            continue;
+        }
+
+        n_running++;
+
+        if (!t.starting && !t.stop_requested) {
+            if (m_attached) {
+                ptrace(PTRACE_INTERRUPT, entry.first, nullptr, nullptr);
+            } else {
+                syscall(SYS_tgkill, m_pid, entry.first, SIGSTOP);
+            }
+
+            t.stop_requested = true;
+        }
+    }
+
+    while (n_running > 0) {
+        int wait_status;
+        pid_t tid = waitpid(-1, &wait_status, __WALL);
+
+        if (tid == -1) {
+            if (errno == ECHILD) {
+                clear_threads();
+            }
+
+            break;
+        }
+
+        if (!handle_thread_event(tid, wait_status) && m_threads.count(tid)) {
+            tracee_thread &t = m_threads.at(tid);
+            t.has_pending_status = true;
+            t.pending_status = wait_status;
+        }
+
+        n_running = 0;
+
+        for (const auto &entry : m_threads) {
+            n_running += entry.second.running;
+        }
+    }
+
+    update_memory_caching();
+}
+
+// Keeps track of thread creation and exit, and of the SIGSTOPs sent by
+// the debugger. Returns true if the event was one of those, and false for
+// stops the user should see.
+bool debugger::handle_thread_event(pid_t tid, int status) {
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        // The main thread only exits with the whole process, which the
+        // caller reports.
+        if (tid == m_pid) {
+            if (m_threads.count(tid)) {
+                m_threads.at(tid).running = false;
+            }
+
+            return false;
+        }
+
+        m_threads.erase(tid);
+        m_debug_registers.remove_thread(tid);
+        std::cout << "[Thread " << std::dec << tid << " exited]" << std::endl;
+
+        if (tid == m_tid) {
+            m_tid = m_pid;
+            m_registers = &m_threads.at(m_pid).registers;
+        }
+
+        return true;
+    }
+
+    // A new thread can report its first stop before its parent reports
+    // the clone.
+    auto it = m_threads.find(tid);
+
+    if (it == m_threads.end()) {
+        it = m_threads.emplace(tid, tid).first;
+        it->second.starting = true;
+    }
+
+    tracee_thread &t = it->second;
+    t.running = false;
+    m_debug_registers.refresh(tid);
+
+    if (status >> 8 == (SIGTRAP | (PTRACE_EVENT_CLONE << 8))) {
+        unsigned long new_tid;
+        ptrace(PTRACE_GETEVENTMSG, tid, nullptr, &new_tid);
+
+        if (!m_threads.count(new_tid)) {
+            m_threads.emplace(new_tid, new_tid).first->second.starting = true;
+        }
+
+        std::cout << "[New thread " << std::dec << new_tid << "]" << std::endl;
+        return true;
+    }
+
+    // Seized threads report PTRACE_EVENT_STOP instead of SIGSTOP, both
+    // when they start and when they are interrupted.
+    bool stopped_quietly = status >> 16 == PTRACE_EVENT_STOP ||
+                           (WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP);
+
+    if (stopped_quietly) {
+        if (t.starting) {
+            t.starting = false;
+            m_debug_registers.add_thread(tid);
+            return true;
+        }
+
+        if (t.stop_requested) {
+            t.stop_requested = false;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Restores every byte the debugger patched and lets all threads go. Threads
+// that stopped at an int3 that hasn't been reported yet are moved back to
+// the breakpoint address, which now holds the original instruction again.
+void debugger::detach() {
+    stop_all_threads();
+
+    for (auto &entry : m_threads) {
+        if (!entry.second.has_pending_status || !WIFSTOPPED(entry.second.pending_status) ||
+            WSTOPSIG(entry.second.pending_status) != SIGTRAP) {
+            continue;
+        }
+
+        uint64_t pc = entry.second.registers.get(reg::rip);
+
+        if (m_breakpoints.count(pc - 1) && m_breakpoints.at(pc - 1).is_enabled()) {
+            entry.second.registers.set(reg::rip, pc - 1);
+        }
+    }
+
+    for (auto &entry : m_breakpoints) {
+        if (entry.second.is_enabled()) {
+            entry.second.disable();
+        }
+    }
+
+    m_breakpoint_sites.apply();
+
+    for (const auto &entry : m_fast_tracepoints) {
+        const std::vector<uint8_t> &original = entry.second.original;
+        m_memory.write(entry.first, original.data(), original.size());
+    }
+
+    m_breakpoints.clear();
+    m_fast_tracepoints.clear();
+    m_debug_registers.clear();
+    invalidate_caches();
+
+    // Signals that stopped threads but were never reported are delivered as
+    // the threads go, rather than lost.
+    for (const auto &entry : m_threads) {
+        int status = entry.second.pending_status;
+        intptr_t signal = 0;
+
+        if (entry.second.has_pending_status && WIFSTOPPED(status) && status >> 16 == 0 &&
+            WSTOPSIG(status) != SIGTRAP) {
+            signal = WSTOPSIG(status);
+        }
+
+        ptrace(PTRACE_DETACH, entry.first, nullptr, reinterpret_cast<void *>(signal));
+    }
+
+    clear_threads();
+    m_detached = true;
+    std::cout << "Detached from process " << std::dec << m_pid << std::endl;
+}
+
+void debugger::select_thread(pid_t tid) {
+    auto it = m_threads.find(tid);
+
+    if (it == m_threads.end()) {
+        throw std::out_of_range("No thread " + std::to_string(tid));
+    }
+
+    if (it->second.running) {
+        throw std::runtime_error("Thread " + std::to_string(tid) + " is running");
+    }
+
+    if (tid != m_tid) {
+        std::cout << "[Switching to thread " << std::dec << tid << "]" << std::endl;
+    }
+
+    m_tid = tid;
+    m_registers = &it->second.registers;
+}
+
+void debugger::print_threads() {
+    for (auto &entry : m_threads) {
+        tracee_thread &t = entry.second;
+        std::cout << (entry.first == m_tid ? "* " : "  ") << std::dec << entry.first;
+
+        if (t.running) {
+            std::cout << " running" << std::endl;
+            continue;
+        }
+
+        uint64_t pc = t.registers.get(reg::rip);
+        std::cout << " 0x" << std::hex << pc;
+
+        try {
+            dwarf::die func = get_function_from_pc(pc);
+            std::cout << " in " << get_function_name(func);
+        } catch (std::out_of_range &) {
+        }
+
+        std::cout << std::endl;
+    }
+}
+
+void debugger::set_breakpoint_at_address(std::intptr_t address) {
+    if (m_breakpoints.count(address)) {
+        return;
+    }
+
+    // An int3 would corrupt the jump to the trampoline.
+    if (find_fast_tracepoint(address) != m_fast_tracepoints.end()) {
+        std::stringstream message;
+        message << "Address 0x" << std::hex << address << " is inside a fast tracepoint";
+        throw std::runtime_error(message.str());
+    }
+
+    breakpoint bp {m_breakpoint_sites, address};
+    bp.enable();
+    m_breakpoints.emplace(address, bp);
+    std::cout << "Set breakpoint at address 0x" << std::hex << address << std::endl;
+}
+
+std::vector<uint64_t> debugger::get_breakpoint_addresses(const std::string &location) {
+    if (is_prefix("0x", location)) {
+        return {std::stoul(location, nullptr, 16)};
+    }
+
+    if (location[0] != '/' && location.find(':') != std::string::npos &&
+        location.find("::") == std::string::npos) {
+        std::vector<std::string> file_and_line = split(location, ':');
+        return get_line_breakpoint_addresses(file_and_line[0], stoi(file_and_line[1]));
+    }
+
+    return get_function_breakpoint_addresses(location);
+}
+
+// Modules are searched in order, and the search stops at the first one
+// defining the function, so shared libraries are only loaded when the
+// executable doesn't have it.
+std::vector<uint64_t> debugger::get_function_breakpoint_addresses(const std::string &name) {
+    std::vector<uint64_t> addresses;
+
+    for (const std::unique_ptr<module> &m : m_modules) {
+        dwarf_index *index = m->get_index();
+
+        if (!index) {
+            continue;
+        }
+
+        for (const dwarf::die &die : index->search_functions(name)) {
+            dwarf::taddr low_pc = at_low_pc(die) + m->get_bias();
+            dwarf::line_table::iterator entry = get_line_entry_from_pc(low_pc);
+            entry++; // Skip prologue.
+            addresses.push_back(entry->address + m->get_bias());
+        }
+
+        if (!addresses.empty()) {
+            break;
+        }
+    }
+
+    return addresses;
+}
+
+void debugger::set_hardware_breakpoint(const std::string &location) {
+    for (uint64_t address : get_breakpoint_addresses(location)) {
+        int slot = m_debug_registers.set(address, debug_condition::execute, 1);
+        std::cout << "Set hardware breakpoint " << slot << " at address 0x" << std::hex
+                  << address << std::endl;
+    }
+}
+
+void debugger::set_watchpoint(const std::string &target, debug_condition condition,
+                              std::size_t size) {
+    uint64_t address;
+
+    if (is_prefix("0x", target)) {
+        address = std::stoul(target, nullptr, 16);
+    } else {
+        std::size_t variable_size;
+
+        if (!get_variable_location(target, address, variable_size)) {
+            std::cerr << "Unknown variable " << target << std::endl;
+            return;
+        }
+
+        if (size == 0) {
+            size = variable_size;
+        }
+    }
+
+    int slot = m_debug_registers.set(address, condition, size == 0 ? 8 : size);
+    std::cout << "Set watchpoint " << slot << " at address 0x" << std::hex << address
+              << std::endl;
+}
+
+// Frees the debug register of a hardware breakpoint, or of a watchpoint if
+// execute is false.
+void debugger::remove_debug_slot(int slot, bool execute) {
+    if (!m_debug_registers.is_used(slot) ||
+        (m_debug_registers.get_condition(slot) == debug_condition::execute) != execute) {
+        std::cerr << "No " << (execute ? "hardware breakpoint " : "watchpoint ") << slot
+                  << std::endl;
+        return;
+    }
+
+    m_debug_registers.remove(slot);
+}
+
+bool debugger::get_variable_location(const std::string &name, uint64_t &address,
+                                     std::size_t &size) {
+    dwarf::die func = get_function_from_pc(get_pc());
+
+    for (const dwarf::die &die : func) {
+        if (die.tag != dwarf::DW_TAG::variable && die.tag != dwarf::DW_TAG::formal_parameter) {
+            continue;
+        }
+
+        if (!die.has(dwarf::DW_AT::name) || at_name(die) != name) {
+            continue;
+        }
+
+        dwarf::value loc_val = die[dwarf::DW_AT::location];
+
+        if (loc_val.get_type() != dwarf::value::type::exprloc) {
+            return false;
+        }
+
+        ptrace_expr_context context {*m_registers, m_memory};
+        dwarf::expr_result result = loc_val.as_exprloc().evaluate(&context);
+
+        if (result.location_type != dwarf::expr_result::type::address) {
+            return false;
+        }
+
+        address = result.value;
+
+        if (is_static_location(loc_val)) {
+            address += get_module(get_pc()).get_bias();
+        }
+        size = 8;
+
+        if (die.has(dwarf::DW_AT::type)) {
+            dwarf::die type = die[dwarf::DW_AT::type].as_reference();
+
+            if (type.has(dwarf::DW_AT::byte_size)) {
+                // Watch the largest leading part a debug register can cover.
+                std::size_t byte_size = type[dwarf::DW_AT::byte_size].as_uconstant();
+                size = byte_size >= 8 ? 8 : byte_size >= 4 ? 4 : byte_size >= 2 ? 2 : 1;
+            }
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+std::vector<uint64_t> debugger::get_line_breakpoint_addresses(const std::string &file,
+                                                               unsigned line) {
+    for (const std::unique_ptr<module> &m : m_modules) {
+        dwarf_index *index = m->get_index();
+
+        if (!index) {
+            continue;
+        }
+
+        index->wait_all();
+
+        for (const dwarf::compilation_unit &cu : m->get_dwarf().compilation_units()) {
+            if (is_suffix(file, at_name(cu.root()))) {
+                const dwarf::line_table &lt = cu.get_line_table();
+
+                for (const dwarf::line_table::entry &entry : lt) {
+                    if (entry.is_stmt && entry.line == line) {
+                        return {entry.address + m->get_bias()};
+                    }
+                }
+            }
+        }
+    }
+
+    return {};
+}
+
+void debugger::set_tracepoint(const std::string &location, const std::string &format) {
+    for (uint64_t address : get_breakpoint_addresses(location)) {
+        // A tracepoint never stops, so it can't share an address with a
+        // breakpoint that should.
+        auto it = m_breakpoints.find(address);
+
+        if (it != m_breakpoints.end() &&
+            (!it->second.get_trace_format() || address == m_loader_breakpoint)) {
+            std::cerr << "Breakpoint already set at address 0x" << std::hex << address
+                      << std::endl;
+            continue;
+        }
+
+        // A format that doesn't compile must not leave a breakpoint that
+        // stops behind.
+        dwarf::die func = get_function_from_pc(address);
+        uint64_t bias = get_module(address).get_bias();
+        auto trace_format = std::make_shared<tracepoint_format>(format, func, bias);
+
+        set_breakpoint_at_address(address);
+        m_breakpoints.at(address).set_trace_format(trace_format);
+    }
+}
+
+void debugger::print_breakpoints() {
+    collect_fast_trace_records();
+
+    for (const auto &entry : m_fast_tracepoints) {
+        std::cout << "0x" << std::hex << entry.first << std::dec << " fast tracepoint, hits: "
+                  << entry.second.hit_count << ", log \"" << entry.second.format->get_text()
+                  << '"' << std::endl;
+    }
+
+    std::vector<const breakpoint *> breakpoints;
+
+    for (const auto &entry : m_breakpoints) {
+        if (static_cast<uint64_t>(entry.first) != m_loader_breakpoint) {
+            breakpoints.push_back(&entry.second);
+        }
+    }
+
+    std::sort(breakpoints.begin(), breakpoints.end(),
+              [](const breakpoint *a, const breakpoint *b) {
+                  return a->get_address() < b->get_address();
+              });
+
+    for (const breakpoint *bp : breakpoints) {
+        std::cout << "0x" << std::hex << bp->get_address() << std::dec
+                  << (bp->get_trace_format() ? " tracepoint" : " breakpoint")
+                  << ", hits: " << bp->get_hit_count();
+
+        if (bp->get_ignore_count()) {
+            std::cout << ", ignore: " << bp->get_ignore_count();
+        }
+
+        if (bp->get_condition()) {
+            std::cout << ", if " << bp->get_condition()->get_text();
+        }
+
+        if (bp->get_trace_format()) {
+            std::cout << ", log \"" << bp->get_trace_format()->get_text() << '"';
+        }
+
+        std::cout << std::endl;
+    }
+}
+
+void debugger::print_trace_log() {
+    collect_fast_trace_records();
+
+    for (const std::string &record : m_trace_log) {
+        std::cout << record << std::endl;
+    }
+}
+
+void debugger::set_fast_tracepoint(const std::string &location, const std::string &format) {
+    const std::size_t jump_size = 5;
+
+    for (uint64_t address : get_breakpoint_addresses(location)) {
+        if (!m_trace_ring) {
+            start_trace_agent(address);
+        }
+
+        // Displace whole instructions covering the jump to the trampoline.
+        uint8_t code[32];
+        read_memory(address, code, sizeof(code));
+
+        std::size_t displaced_size = 0;
+
+        while (displaced_size < jump_size) {
+            displaced_size += decode_instruction(code + displaced_size,
+                                                 sizeof(code) - displaced_size).length;
+        }
+
+        check_displaced_range(address, address + displaced_size);
+
+        // Records only hold registers, and memory is read when they are
+        // drained, so anything in memory would have changed by then.
+        dwarf::die func = get_function_from_pc(address);
+        uint64_t bias = get_module(address).get_bias();
+        auto trace_format = std::make_shared<tracepoint_format>(format, func, bias);
+
+        if (trace_format->reads_memory()) {
+            throw std::invalid_argument("Fast tracepoints can only log registers");
+        }
+
+        std::vector<uint8_t> displaced {code, code + displaced_size};
+        uint64_t trampoline = m_trampolines + m_trampolines_used;
+        std::vector<uint8_t> trampoline_code =
+            build_trace_trampoline(trampoline, address, displaced, m_trace_ring_address);
+
+        if (m_trampolines_used + trampoline_code.size() > trampolines_size) {
+            throw std::runtime_error("No room left for trampolines");
+        }
+
+        std::vector<uint8_t> jump;
+        emit_jump(jump, address, trampoline);
+        jump.resize(displaced_size, 0x90); // Pad with nops.
+
+        m_memory.write(trampoline, trampoline_code.data(), trampoline_code.size());
+        m_memory.write(address, jump.data(), jump.size());
+        m_trampolines_used += trampoline_code.size();
+
+        m_fast_tracepoints.emplace(address, fast_tracepoint {displaced, trace_format, 0});
+        std::cout << "Set fast tracepoint at address 0x" << std::hex << address << std::endl;
+    }
+}
+
+// Throws if the instructions in [low, high) can't be replaced by a jump:
+// a breakpoint or fast tracepoint is already there, a thread has stopped
+// in the middle of them, or a direct branch in their function targets one
+// after the first. Indirect branches can't be checked.
+void debugger::check_displaced_range(uint64_t low, uint64_t high) {
+    for (uint64_t a = low; a < high; a++) {
+        if (m_breakpoints.count(a) || find_fast_tracepoint(a) != m_fast_tracepoints.end()) {
+            throw std::runtime_error("Fast tracepoint overlaps another breakpoint");
+        }
+    }
+
+    for (auto &entry : m_threads) {
+        if (entry.second.running) {
+            throw std::runtime_error("Cannot set fast tracepoints while threads are running");
+        }
+
+        uint64_t pc = entry.second.registers.get().rip;
+
+        if (pc > low && pc < high) {
+            throw std::runtime_error("Thread " + std::to_string(entry.first) +
+                                     " is stopped inside the fast tracepoint");
+        }
+    }
+
+    dwarf::die func = get_function_from_pc(low);
+    uint64_t bias = get_module(low).get_bias();
+
+    for (const dwarf::rangelist::entry &range : die_pc_range(func)) {
+        uint64_t start = range.low + bias;
+        uint64_t end = range.high + bias;
+        std::vector<uint8_t> code(end - start);
+        read_code(start, code.data(), code.size());
+
+        for (uint64_t address = start; address < end;) {
+            const uint8_t *ins_code = code.data() + (address - start);
+            x86_instruction ins;
+
+            try {
+                ins = decode_instruction(ins_code, end - address);
+            } catch (std::invalid_argument &) {
+                throw std::runtime_error("Cannot decode the branches around the fast tracepoint");
+            }
+
+            if (ins.branch == branch_kind::call || ins.branch == branch_kind::jump ||
+                ins.branch == branch_kind::conditional_jump) {
+                uint64_t target = get_branch_target(ins_code, ins, address);
+
+                if (target > low && target < high) {
+                    std::stringstream message;
+                    message << "Branch at 0x" << std::hex << address
+                            << " targets the middle of the fast tracepoint";
+                    throw std::runtime_error(message.str());
+                }
+            }
+
+            address += ins.length;
+        }
+    }
+}
+
+// Returns the fast tracepoint whose jump covers address, or the end of
+// m_fast_tracepoints if there is none.
+std::map<uint64_t, fast_tracepoint>::const_iterator
+debugger::find_fast_tracepoint(uint64_t address) const {
+    auto next = m_fast_tracepoints.upper_bound(address);
+
+    if (next == m_fast_tracepoints.begin()) {
+        return m_fast_tracepoints.end();
+    }
+
+    auto it = std::prev(next);
+    return address < it->first + it->second.original.size() ? it : m_fast_tracepoints.end();
+}
+
+// Maps the trace ring and a trampoline area into the tracee by making it
+// run mmap and open system calls. The trampolines are placed within reach
+// of a rel32 jump from the first site.
+void debugger::start_trace_agent(uint64_t near) {
+    std::unique_ptr<trace_ring> ring {new trace_ring {m_pid}};
+
+    uint64_t trampolines = map_near(near, trampolines_size);
+
+    if (!trampolines) {
+        std::stringstream message;
+        message << "Cannot map trampolines near 0x" << std::hex << near;
+        throw std::runtime_error(message.str());
+    }
+
+    // The path is written to the start of the trampoline area, which is
+    // only used for trampolines afterwards.
+    const std::string &path = ring->get_path();
+    m_memory.write(trampolines, reinterpret_cast<const uint8_t *>(path.c_str()),
+                   path.size() + 1);
+
+    uint64_t fd = inject_syscall(SYS_open, {trampolines, O_RDWR});
+
+    if (fd > static_cast<uint64_t>(-4096)) {
+        inject_syscall(SYS_munmap, {trampolines, trampolines_size});
+        throw std::runtime_error("Tracee cannot open " + path);
+    }
+
+    uint64_t address = inject_syscall(
+        SYS_mmap, {0, ring->get_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0});
+    inject_syscall(SYS_close, {fd});
+    ring->unlink_path();
+
+    if (address > static_cast<uint64_t>(-4096)) {
+        inject_syscall(SYS_munmap, {trampolines, trampolines_size});
+        throw std::runtime_error("Tracee cannot map the trace ring");
+    }
+
+    m_trace_ring = std::move(ring);
+    m_trace_ring_address = address;
+    m_trampolines = trampolines;
+    m_trampolines_used = 0;
+}
+
+// Maps executable memory into the tracee within reach of a rel32 operand
+// at address near. Returns 0 if no such mapping could be made.
+uint64_t debugger::map_near(uint64_t near, std::size_t size) {
+    const int map_fixed_noreplace = 0x100000;
+    const int64_t max_distance = 0x7FFF0000;
+
+    for (int64_t distance : {1LL << 30, -(1LL << 30), 1LL << 28, -(1LL << 28), 1LL << 24}) {
+        uint64_t hint = (near + distance) & ~(page_size - 1);
+        uint64_t result = inject_syscall(
+            SYS_mmap, {hint, size, PROT_READ | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANONYMOUS | map_fixed_noreplace,
+                       static_cast<uint64_t>(-1), 0});
+
+        if (result > static_cast<uint64_t>(-4096)) {
+            continue;
+        }
+
+        if (std::llabs(static_cast<int64_t>(result - near)) < max_distance) {
+            return result;
+        }
+
+        inject_syscall(SYS_munmap, {result, size});
+    }
+
+    return 0;
+}
+
+// Formats the records drained from the trace ring. Registers come from the
+// records, but memory is read as it is now.
+void debugger::collect_fast_trace_records() {
+    if (!m_trace_ring) {
+        return;
+    }
+
+    for (const trace_record &record : m_trace_ring->take()) {
+        auto it = m_fast_tracepoints.find(record.regs.rip);
+
+        if (it == m_fast_tracepoints.end()) {
+            continue;
+        }
+
+        fast_tracepoint &tp = it->second;
+        tp.hit_count++;
+
+        register_cache snapshot {m_pid};
+        snapshot.load(record.regs);
+
+        if (m_trace_log.size() == max_trace_records) {
+            m_trace_log.pop_front();
+        }
+
+        std::stringstream line;
+        line << "0x" << std::hex << it->first << std::dec << " #" << tp.hit_count << ": "
+             << tp.format->format(snapshot, m_memory);
+        m_trace_log.push_back(line.str());
+    }
+}
+
+// Runs one system call in the tracee, using a syscall instruction written
+// over the current one, and restores its code and registers.
+uint64_t debugger::inject_syscall(long number, std::initializer_list<uint64_t> args) {
+    const uint8_t syscall_code[] = {0x0F, 0x05};
+    const std::array<reg, 6> arg_registers = {{
+        reg::rdi, reg::rsi, reg::rdx, reg::r10, reg::r8, reg::r9,
+    }};
+
+    user_regs_struct saved = m_registers->get();
+    uint8_t saved_code[sizeof(syscall_code)];
+    read_memory(saved.rip, saved_code, sizeof(saved_code));
+    m_memory.write(saved.rip, syscall_code, sizeof(syscall_code));
+
+    user_regs_struct regs = saved;
+    set_register_value(regs, reg::rax, number);
+    set_register_value(regs, reg::orig_rax, -1);
+
+    std::size_t i = 0;
+
+    for (uint64_t arg : args) {
+        set_register_value(regs, arg_registers[i++], arg);
+    }
+
+    m_registers->set(regs);
+    invalidate_caches();
+    ptrace(PTRACE_SINGLESTEP, m_tid, nullptr, nullptr);
+
+    int wait_status;
+    waitpid(m_tid, &wait_status, __WALL);
+
+    uint64_t result = m_registers->get(reg::rax);
+
+    m_memory.write(saved.rip, saved_code, sizeof(saved_code));
+    m_registers->set(saved);
+
+    return result;
+}
+
+void debugger::remove_breakpoint(std::intptr_t address) {
+    if (m_breakpoints.at(address).is_enabled()) {
+        m_breakpoints.at(address).disable();
+    }
+
+    m_breakpoints.erase(address);
+}
+
+void debugger::dump_registers() {
+    for (const reg_descriptor &rd : g_register_descriptors) {
+        std::cout << std::left << std::setfill(' ') << std::setw(8) << rd.name
+                  << " 0x" << std::right << std::setfill('0') << std::setw(16)
+                  << std::hex << m_registers->get(rd.r) << std::endl;
+    }
+}
+
+void debugger::dump_memory(uint64_t address, std::size_t size) {
+    const std::size_t bytes_per_line = 16;
+
+    std::vector<uint8_t> data(size);
+    read_memory(address, data.data(), size);
+
+    for (std::size_t offset = 0; offset < size; offset += bytes_per_line) {
+        std::size_t n = std::min(bytes_per_line, size - offset);
+
+        std::cout << std::right << std::setfill('0') << std::setw(16) << std::hex
+                  << address + offset << ' ';
+
+        for (std::size_t i = 0; i < bytes_per_line; i++) {
+            if (i < n) {
+                std::cout << ' ' << std::setw(2) << static_cast<unsigned>(data[offset + i]);
+            } else {
+                std::cout << "   ";
+            }
+        }
+
+        std::cout << "  |";
+
+        for (std::size_t i = 0; i < n; i++) {
+            uint8_t c = data[offset + i];
+            std::cout << (std::isprint(c) ? static_cast<char>(c) : '.');
+        }
+
+        std::cout << '|' << std::endl;
+    }
+}
+
+uint64_t debugger::read_memory(uint64_t address) {
+    uint64_t value;
+    read_memory(address, reinterpret_cast<uint8_t *>(&value), sizeof(value));
+    return value;
+}
+
+void debugger::read_memory(uint64_t address, uint8_t *data, std::size_t size) {
+    m_memory.read(address, data, size);
+}
+
+void debugger::write_memory(uint64_t address, uint64_t value) {
+    m_memory.write(address, reinterpret_cast<const uint8_t *>(&value), sizeof(value));
+}
+
+uint64_t debugger::get_pc() {
+    require_process();
+    return m_registers->get(reg::rip);
+}
+
+void debugger::set_pc(uint64_t pc) {
+    require_process();
+    m_registers->set(reg::rip, pc);
+}
+
+void debugger::step_single_instruction() {
+    invalidate_caches();
+    resume_thread(m_tid, PTRACE_SINGLESTEP);
+    wait_for_signal(m_tid);
+}
+
+void debugger::step_single_instruction_with_breakpoint_check() {
+    uint64_t pc = get_pc();
+
+    if (m_breakpoints.count(pc) || m_debug_registers.find_execute(pc) != -1) {
+        step_over_breakpoint();
+    } else {
+        step_single_instruction();
+    }
+}
+
+// Runs the selected thread until it takes a branch, with PTRACE_SINGLEBLOCK,
+// which has the CPU trap on taken branches (BTF in DEBUGCTL) rather than on
+// every instruction. Single-steps where that isn't supported, or to get
+// past a breakpoint.
+void debugger::step_block() {
+    uint64_t pc = get_pc();
+
+    if (!m_block_step || m_breakpoints.count(pc) || m_debug_registers.find_execute(pc) != -1) {
+        step_single_instruction_with_breakpoint_check();
+        return;
+    }
+
+    invalidate_caches();
+
+    if (!resume_thread(m_tid, PTRACE_SINGLEBLOCK)) {
+        m_block_step = false;
+        step_single_instruction();
+        return;
+    }
+
+    wait_for_signal(m_tid);
+}
+
+void debugger::step_over_breakpoint() {
+    uint64_t pc = get_pc();
+    breakpoint *bp = nullptr;
+
+    if (m_breakpoints.count(pc) && m_breakpoints.at(pc).is_enabled()) {
+        bp = &m_breakpoints.at(pc);
+    }
+
+    // Execution breakpoints fire before the instruction runs, so they have
+    // to be disabled to get past it, just like software ones.
+    int slot = m_debug_registers.find_execute(pc);
+
+    if (!bp && slot == -1) {
+        return;
+    }
+
+    if (step_displaced()) {
+        return;
+    }
+
+    // An instruction that doesn't branch but leaves pc where it was is a
+    // repeated string instruction that isn't done yet, so it is stepped
+    // until it is, rather than hitting the breakpoint again.
+    bool repeats = false;
+
+    try {
+        uint8_t code[max_instruction_size];
+        read_code(pc, code, sizeof(code));
+        repeats = decode_instruction(code, sizeof(code)).branch == branch_kind::none;
+    } catch (std::runtime_error &) {
+    } catch (std::invalid_argument &) {
+    }
+
+    if (bp) {
+        bp->disable();
+    }
+
+    if (slot != -1) {
+        m_debug_registers.disable(slot);
+    }
+
+    do {
+        step_single_instruction();
+    } while (repeats && m_threads.count(m_tid) && get_pc() == pc &&
+             get_signal_info().si_signo == SIGTRAP);
+
+    if (bp) {
+        bp->enable();
+    }
+
+    if (slot != -1) {
+        m_debug_registers.enable(slot);
+    }
+}
+
+// Single-steps a copy of the instruction at pc in the scratch area, so the
+// breakpoints on it can stay inserted, and moves pc back as if it had run
+// in place. Returns false if the instruction cannot be displaced.
+bool debugger::step_displaced() {
+    uint64_t pc = get_pc();
+
+    if (!m_scratch_mapped) {
+        m_scratch_mapped = true;
+        m_scratch = map_near(pc, page_size);
+    }
+
+    if (!m_scratch) {
+        return false;
+    }
+
+    uint64_t &scratch = m_threads.at(m_tid).scratch;
+
+    if (!scratch) {
+        std::unordered_set<uint64_t> used;
+
+        for (const auto &entry : m_threads) {
+            used.insert(entry.second.scratch);
+        }
+
+        for (uint64_t slot = m_scratch; slot < m_scratch + page_size; slot += scratch_slot_size) {
+            if (!used.count(slot)) {
+                scratch = slot;
+                break;
+            }
+        }
+
+        if (!scratch) {
+            return false;
+        }
+    }
+
+    uint8_t code[max_instruction_size];
+
+    try {
+        read_code(pc, code, sizeof(code));
+    } catch (std::runtime_error &) {
+        // The instruction is too close to the end of its mapping.
+        return false;
+    }
+
+    x86_instruction ins;
+    std::vector<uint8_t> displaced;
+
+    try {
+        ins = decode_instruction(code, sizeof(code));
+
+        // Relative branches are copied unchanged and their target is
+        // moved back afterwards, which also works for rel8 forms.
+        if (ins.rel_size) {
+            displaced.assign(code, code + ins.length);
+        } else {
+            displaced = relocate_instructions(code, ins.length, pc, scratch);
+        }
+    } catch (std::invalid_argument &) {
+        return false;
+    }
+
+    m_memory.write(scratch, displaced.data(), displaced.size());
+    set_pc(scratch);
+
+    // Repeated string instructions stay put until they are done. Their
+    // progress is kept in registers, so one that takes too long is moved
+    // back and finished in place by step_over_breakpoint.
+    std::size_t steps = 0;
+
+    do {
+        step_single_instruction();
+    } while (m_threads.count(m_tid) && get_pc() == scratch &&
+             get_signal_info().si_signo == SIGTRAP && ++steps < max_displaced_steps);
+
+    if (!m_threads.count(m_tid)) {
+        return true;
+    }
+
+    uint64_t next = get_pc();
+
+    if (next == scratch && steps == max_displaced_steps) {
+        set_pc(pc);
+        return false;
+    }
+
+    if (ins.rel_size || (next >= scratch && next <= scratch + ins.length)) {
+        set_pc(next - scratch + pc);
+    }
+
+    if (ins.branch == branch_kind::call || ins.branch == branch_kind::indirect_call) {
+        uint64_t sp = m_registers->get(reg::rsp);
+
+        if (read_memory(sp) == scratch + ins.length) {
+            write_memory(sp, pc + ins.length);
+        }
+    }
+
+    return true;
+}
+
+// Reads the tracee's code as it is without breakpoints.
+void debugger::read_code(uint64_t address, uint8_t *code, std::size_t size) {
+    read_memory(address, code, size);
+    m_breakpoint_sites.restore(address, code, size);
+}
+
+bool debugger::has_line_entry(uint64_t pc) {
+    try {
+        get_line_entry_from_pc(pc);
+        return true;
+    } catch (std::out_of_range &) {
+        return false;
+    }
+}
+
+// Plants breakpoints for a stepping command where there are none yet. The
+// jump of a fast tracepoint can't take an int3, so one that would land on
+// it goes where the trampoline returns to instead.
+void debugger::set_step_breakpoints(const std::unordered_set<uint64_t> &addresses) {
+    for (uint64_t address : addresses) {
+        for (auto tp = find_fast_tracepoint(address); tp != m_fast_tracepoints.end();
+             tp = find_fast_tracepoint(address)) {
+            address = tp->first + tp->second.original.size();
+        }
+
+        if (!m_breakpoints.count(address)) {
+            breakpoint bp {m_breakpoint_sites, static_cast<std::intptr_t>(address)};
+            bp.enable();
+            m_breakpoints.emplace(address, bp);
+            m_step_breakpoints.insert(address);
+        }
+    }
+}
+
+void debugger::remove_step_breakpoints() {
+    for (uint64_t address : m_step_breakpoints) {
+        remove_breakpoint(address);
+    }
+
+    m_step_breakpoints.clear();
+}
+
+// Runs the selected thread until it reaches one of addresses, through
+// breakpoints that are removed again afterwards. Other threads that reach
+// them are resumed. Returns false if the thread stopped anywhere else,
+// including at a user's breakpoint, or the process exited.
+bool debugger::run_to(const std::unordered_set<uint64_t> &addresses) {
+    pid_t tid = m_tid;
+
+    set_step_breakpoints(addresses);
+    continue_execution();
+
+    while (m_threads.count(tid) && m_tid != tid && m_step_breakpoints.count(get_pc())) {
+        select_thread(tid);
+        continue_execution();
+    }
+
+    bool reached = m_threads.count(tid) && m_tid == tid && m_step_breakpoints.count(get_pc());
+    remove_step_breakpoints();
+
+    return reached;
+}
+
+// Steps to the next line by running to breakpoints rather than stepping
+// each instruction. The instructions of the current line are decoded, and
+// breakpoints go on the targets of branches that leave it and on the end
+// of the line. Stepping into calls also stops at the targets of calls into
+// code with line information; stepping over them stops at the return
+// address from the CFI instead, and ignores stops in deeper frames, which
+// come from recursion. Only indirect branches, and returns when stepping
+// into calls, are single-stepped, since their targets aren't known until
+// they run. Lines that can't be decoded are run a branch at a time.
+void debugger::step_line(bool into_calls) {
+    pid_t tid = m_tid;
+    dwarf::line_table::iterator start = get_line_entry_from_pc(get_pc());
+    std::string file = start->file->path;
+    unsigned line = start->line;
+
+    unwind_frame caller = get_innermost_frame();
+    uint64_t cfa = 0;
+    uint64_t return_address = 0;
+
+    if (unwind(caller, true)) {
+        cfa = caller.regs[cfi_rsp];
+        return_address = into_calls ? 0 : caller.pc;
+    }
+
+    for (;;) {
+        uint64_t pc = get_pc();
+        dwarf::line_table::iterator entry = get_line_entry_from_pc(pc);
+
+        if (entry->line != line || entry->file->path != file) {
+            break;
+        }
+
+        // The line runs on through the rows that follow with the same line.
+        uint64_t bias = get_module(pc).get_bias();
+        uint64_t low = entry->address + bias;
+        dwarf::line_table::iterator end = entry;
+
+        while (!end->end_sequence && end->line == line && end->file->path == file) {
+            end++;
+        }
+
+        uint64_t high = end->address + bias;
+        std::vector<uint8_t> code(high - low);
+        read_code(low, code.data(), code.size());
+
+        std::unordered_set<uint64_t> targets {high};
+        bool single_step = false;
+        bool indirect_call = false;
+        bool decoded = true;
+
+        if (return_address) {
+            targets.insert(return_address);
+        }
+
+        for (uint64_t address = low; address < high && !single_step;) {
+            const uint8_t *ins_code = code.data() + (address - low);
+            x86_instruction ins;
+
+            try {
+                ins = decode_instruction(ins_code, high - address);
+            } catch (std::invalid_argument &) {
+                decoded = false;
+                break;
+            }
+
+            bool unknown_target = ins.branch == branch_kind::indirect_jump;
+
+            switch (ins.branch) {
+                case branch_kind::jump:
+                case branch_kind::conditional_jump: {
+                    uint64_t target = get_branch_target(ins_code, ins, address);
+
+                    if (target < low || target >= high) {
+                        targets.insert(target);
+                    }
+
+                    break;
+                }
+
+                case branch_kind::call: {
+                    uint64_t target = get_branch_target(ins_code, ins, address);
+
+                    if (into_calls && has_line_entry(target)) {
+                        targets.insert(target);
+                    }
+
+                    break;
+                }
+
+                case branch_kind::indirect_call:
+                case branch_kind::ret:
+                    unknown_target = into_calls;
+                    break;
+
+                case branch_kind::indirect_jump:
+                case branch_kind::none:
+                    break;
+            }
+
+            if (unknown_target && address == pc) {
+                single_step = true;
+                indirect_call = ins.branch == branch_kind::indirect_call;
+            } else if (unknown_target) {
+                targets.insert(address);
+            }
+
+            address += ins.length;
+        }
+
+        if (!decoded) {
+            // The breakpoint stops the block from running on past the line.
+            set_step_breakpoints({high});
+            step_block();
+            remove_step_breakpoints();
+
+            if (!m_threads.count(tid)) {
+                return;
+            }
+
+            // A block that ends in a call stops at the callee's entry.
+            if (is_below_frame(cfa) && (!into_calls || !has_line_entry(get_pc())) &&
+                !run_to({read_memory(m_registers->get(reg::rsp))})) {
+                return;
+            }
+
+            continue;
+        }
+
+        if (!single_step) {
+            bool reached;
+
+            do {
+                reached = run_to(targets);
+            } while (reached && !into_calls && is_below_frame(cfa));
+
+            if (!reached) {
+                return;
+            }
+
+            continue;
+        }
+
+        step_single_instruction_with_breakpoint_check();
+
+        // Calls into code without line information run until they return.
+        if (indirect_call && !has_line_entry(get_pc()) &&
+            !run_to({read_memory(m_registers->get(reg::rsp))})) {
+            return;
+        }
+    }
+
+    dwarf::line_table::iterator line_entry = get_line_entry_from_pc(get_pc());
+    print_source(line_entry->file->path, line_entry->line);
+}
+
+// Returns the canonical frame address of the selected thread's innermost
+// frame, or 0 if it can't be unwound.
+uint64_t debugger::get_frame_cfa() {
+    unwind_frame frame = get_innermost_frame();
+    return unwind(frame, true) ? frame.regs[cfi_rsp] : 0;
+}
+
+// Whether the selected thread is in a frame called, directly or not, from
+// the frame whose canonical frame address is cfa. Frames are compared by
+// CFA since the stack grows down. A cfa of 0 is an unknown frame.
+bool debugger::is_below_frame(uint64_t cfa) {
+    uint64_t current = get_frame_cfa();
+    return cfa && current && current < cfa;
+}
+
+void debugger::step_in() {
+    step_line(true);
+}
+
+void debugger::step_over() {
+    step_line(false);
+}
+
+// Runs to the return address found by unwinding, skipping returns to it
+// from deeper, recursive frames. A recursive call made from the same call
+// site returns to the frame being left, whose CFA is cfa, so only a frame
+// above it is the caller.
+void debugger::step_out() {
+    unwind_frame caller = get_innermost_frame();
+
+    if (!unwind(caller, true)) {
+        std::cerr << "Cannot find the return address" << std::endl;
+        return;
+    }
+
+    uint64_t cfa = caller.regs[cfi_rsp];
+    bool reached;
+    uint64_t current;
+
+    do {
+        reached = run_to({caller.pc});
+    } while (reached && (current = get_frame_cfa()) && current <= cfa);
+
+    if (reached && has_line_entry(get_pc())) {
+        dwarf::line_table::iterator line_entry = get_line_entry_from_pc(get_pc());
+        print_source(line_entry->file->path, line_entry->line);
+    }
+}
+
+// Waits for a stop of thread tid, or of any thread if tid is -1, and
+// selects the thread that stopped. Stops that were left pending by
+// stopping all threads are reported first.
+void debugger::wait_for_signal(pid_t tid) {
+    m_auto_resume = false;
+
+    int wait_status = 0;
+    pid_t stopped = 0;
+
+    // The exit of the process is reported whichever thread is waited for.
+    for (auto &entry : m_threads) {
+        tracee_thread &t = entry.second;
+        bool exited = WIFEXITED(t.pending_status) || WIFSIGNALED(t.pending_status);
+
+        if (t.has_pending_status && (tid == -1 || entry.first == tid || exited)) {
+            stopped = entry.first;
+            wait_status = t.pending_status;
+            t.has_pending_status = false;
+            break;
+        }
+    }
+
+    while (!stopped) {
+        pid_t waited = waitpid(tid, &wait_status, __WALL);
+
+        if (waited == -1) {
+            std::cout << "No threads left to wait for" << std::endl;
+
+            if (errno == ECHILD) {
+                clear_threads();
+            }
+
+            return;
+        }
+
+        if (!handle_thread_event(waited, wait_status)) {
+            stopped = waited;
+        } else if (m_threads.count(waited) && (tid == -1 || waited == tid)) {
+            resume_thread(waited, m_threads.at(waited).resume_request);
+        }
+    }
+
+    if (WIFEXITED(wait_status)) {
+        std::cout << "Process exited with status " << std::dec << WEXITSTATUS(wait_status)
+                  << std::endl;
+    } else if (WIFSIGNALED(wait_status)) {
+        std::cout << "Process terminated by signal " << strsignal(WTERMSIG(wait_status))
+                  << std::endl;
+    }
+
+    if (WIFEXITED(wait_status) || WIFSIGNALED(wait_status)) {
+        clear_threads();
+        return;
+    }
+
+    select_thread(stopped);
+
+    if (m_all_stop) {
+        stop_all_threads();
+    } else {
+        update_memory_caching();
+    }
+
+    // The process can be gone by the time its threads have been stopped.
+    if (m_threads.empty()) {
+        std::cout << "Process exited" << std::endl;
+        return;
+    }
+
+    siginfo_t info = get_signal_info();
+
+    switch (info.si_signo) {
+        case SIGTRAP:
+            handle_sigtrap(info);
+            break;
+
+        case SIGSEGV:
+            std::cout << "Segmentation fault. Reason: " << info.si_code << std::endl;
+            break;
+
+        default:
+            std::cout << "Got signal: " << strsignal(info.si_signo) << std::endl;
+            break;
+    }
+}
+
+// Both lookups take runtime addresses, but return DIEs and line table
+// entries with file addresses.
+dwarf::die debugger::get_function_from_pc(uint64_t pc) {
+    module &m = get_module(pc);
+    dwarf_index *index = m.get_index();
+
+    if (index) {
+        for (const dwarf::die &die : index->find_functions(pc - m.get_bias())) {
+            if (die.tag == dwarf::DW_TAG::subprogram) {
+                return die;
+            }
+        }
+    }
+
+    throw std::out_of_range("Unknown function");
+}
+
+dwarf::line_table::iterator debugger::get_line_entry_from_pc(uint64_t pc) {
+    module &m = get_module(pc);
+    dwarf_index *index = m.get_index();
+    const dwarf::compilation_unit *cu =
+        index ? index->find_compilation_unit(pc - m.get_bias()) : nullptr;
+
+    if (!cu) {
+        throw std::out_of_range("Unknown line entry");
+    }
+
+    const dwarf::line_table &lt = cu->get_line_table();
+    dwarf::line_table::iterator it = lt.find_address(pc - m.get_bias());
+
+    if (it == lt.end()) {
+        throw std::out_of_range("Unknown line entry");
+    }
+
+    return it;
+}
+
+void debugger::print_source(const std::string &filename, unsigned line, unsigned n_lines_context) {
+    std::ifstream file {filename};
+
+    unsigned start_line = line <= n_lines_context ? 1 : line - n_lines_context;
+    unsigned end_line = line + n_lines_context + 1 +
+                        (line < n_lines_context ? n_lines_context - line : 0);
+
+    char c {};
+    unsigned current_line = 1;
+
+    while (current_line != start_line && file.get(c)) {
+        if (c == '\n') {
+            current_line++;
+        }
+    }
+
+    std::cout << (current_line == line ? "> " : "  ");
+
+    while (current_line != end_line && file.get(c)) {
+        std::cout << c;
+
+        if (c == '\n') {
+            current_line++;
+            std::cout << (current_line == line ? "> " : "  ");
+        }
+    }
+
+    std::cout << std::endl;
+}
+
+void debugger::print_backtrace() {
+    const std::size_t max_frames = 1 << 16;
+    unwind_frame frame = get_innermost_frame();
+
+    for (std::size_t n = 0; n < max_frames; n++) {
+        std::string name = "??";
+
+        // Return addresses can be just past the end of the calling function.
+        try {
+            name = get_function_name(get_function_from_pc(n == 0 ? frame.pc : frame.pc - 1));
+        } catch (std::out_of_range &) {
+        }
+
+        std::cout << "frame #" << std::dec << n << ": 0x" << std::hex << frame.pc << ' ' << name
+                  << std::endl;
+
+        if (!unwind(frame, n == 0)) {
+            break;
+        }
+    }
+}
+
+unwind_frame debugger::get_innermost_frame() {
+    const user_regs_struct &regs = m_registers->get();
+    unwind_frame frame {regs.rip, {}, 0};
+
+    for (int r = 0; r < cfi_return_address; r++) {
+        frame.regs[r] = get_register_value_from_dwarf_register(regs, r);
+        frame.valid |= 1u << r;
+    }
+
+    return frame;
+}
+
+// Replaces frame with its caller. See unwind_caller.
+bool debugger::unwind(unwind_frame &frame, bool innermost) {
+    module *m = nullptr;
+
+    try {
+        m = &get_module(frame.pc);
+    } catch (std::out_of_range &) {
+    }
+
+    // A corrupt frame can point anywhere, which just ends the unwind.
+    return unwind_caller(frame, innermost, m, [this](uint64_t address, uint64_t &value) {
+        try {
+            value = read_memory(address);
+            return true;
+        } catch (std::runtime_error &) {
+            return false;
+        }
+    });
+}
+
+// Samples the stacks of all threads hz times a second until the process
+// exits. Each sample stops every thread, records the raw return addresses
+// and resumes; names are only looked up once, when the report is written.
+// Folded stacks go to output, and the functions with the most samples to
+// standard output.
+void debugger::profile(unsigned hz, std::size_t top_n, const std::string &output) {
+    const std::size_t max_depth = 1024;
+
+    start();
+    m_all_stop = false;
+
+    std::map<std::vector<uint64_t>, uint64_t> samples;
+    uint64_t n_samples = 0;
+
+    // The tracee's stops are picked up through SIGCHLD, so the wait between
+    // samples doesn't need to poll.
+    sigset_t sigchld;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, nullptr);
+
+    auto interval = std::chrono::nanoseconds(1000000000 / hz);
+    auto next_sample = std::chrono::steady_clock::now() + interval;
+
+    for (const auto &entry : m_threads) {
+        resume_thread(entry.first, PTRACE_CONT);
+    }
+
+    while (!m_threads.empty()) {
+        auto now = std::chrono::steady_clock::now();
+
+        if (now < next_sample) {
+            auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(next_sample - now);
+            timespec timeout {static_cast<time_t>(wait.count() / 1000000000),
+                              static_cast<long>(wait.count() % 1000000000)};
+            sigtimedwait(&sigchld, nullptr, &timeout);
+        }
+
+        int wait_status;
+        pid_t tid;
+
+        while (!m_threads.empty() && (tid = waitpid(-1, &wait_status, __WALL | WNOHANG)) > 0) {
+            if (handle_thread_event(tid, wait_status)) {
+                if (m_threads.count(tid)) {
+                    resume_thread(tid, PTRACE_CONT);
+                }
+            } else if (WIFEXITED(wait_status) || WIFSIGNALED(wait_status)) {
+                clear_threads();
+            } else {
+                resume_thread(tid, PTRACE_CONT, handle_profile_stop(tid, wait_status));
+            }
+        }
+
+        if (m_threads.empty() || std::chrono::steady_clock::now() < next_sample) {
+            continue;
+        }
+
+        stop_all_threads();
+
+        // The process can exit while its threads are being stopped.
+        if (!m_threads.empty() && m_threads.at(m_pid).has_pending_status &&
+            !WIFSTOPPED(m_threads.at(m_pid).pending_status)) {
+            clear_threads();
+        }
+
+        if (m_threads.empty()) {
+            break;
+        }
+
+        for (auto &entry : m_threads) {
+            if (entry.second.running) {
+                continue;
+            }
+
+            m_tid = entry.first;
+            m_registers = &entry.second.registers;
+
+            std::vector<uint64_t> stack;
+            unwind_frame frame = get_innermost_frame();
+
+            do {
+                stack.push_back(frame.pc);
+            } while (stack.size() < max_depth && unwind(frame, stack.size() == 1));
+
+            samples[stack]++;
+            n_samples++;
+        }
+
+        std::map<pid_t, int> signals;
+
+        for (auto &entry : m_threads) {
+            if (entry.second.has_pending_status) {
+                int status = entry.second.pending_status;
+                entry.second.has_pending_status = false;
+                signals[entry.first] = handle_profile_stop(entry.first, status);
+            }
+        }
+
+        m_memory.flush();
+
+        for (const auto &entry : m_threads) {
+            if (!entry.second.running) {
+                resume_thread(entry.first, PTRACE_CONT, signals[entry.first]);
+            }
+        }
+
+        next_sample += interval;
+
+        if (next_sample < std::chrono::steady_clock::now()) {
+            next_sample = std::chrono::steady_clock::now() + interval;
+        }
+    }
+
+    sigprocmask(SIG_UNBLOCK, &sigchld, nullptr);
+
+    write_profile(samples, n_samples, top_n, output,
+                  [this](uint64_t pc, bool innermost) { return get_frame_names(pc, innermost); });
+}
+
+// Deals with a stop that happened while profiling and returns the signal
+// to deliver when the thread is resumed. The only breakpoint is the one
+// in the dynamic linker.
+int debugger::handle_profile_stop(pid_t tid, int status) {
+    if (WSTOPSIG(status) != SIGTRAP) {
+        return WSTOPSIG(status);
+    }
+
+    m_tid = tid;
+    m_registers = &m_threads.at(tid).registers;
+    siginfo_t info = get_signal_info();
+
+    if (info.si_code == TRAP_BRKPT || info.si_code == SI_KERNEL) {
+        uint64_t pc = get_pc() - 1;
+
+        if (pc == m_loader_breakpoint) {
+            set_pc(pc);
+            update_modules();
+            step_over_breakpoint();
+        }
+    }
+
+    return 0;
+}
+
+// Runs the program with a one-shot breakpoint on every statement row of
+// the executable's compilation units, or of those whose name contains one
+// of sources. Each breakpoint is removed when it is first hit, so code
+// runs at full speed once it has been covered. Line coverage is written to
+// output in lcov format when the process exits. Lines are only known to be
+// hit or not, so their counts are 0 or 1.
+void debugger::coverage(const std::vector<std::string> &sources, const std::string &output) {
+    start();
+    m_all_stop = false;
+
+    module &m = *m_modules.front();
+
+    if (!m.get_index()) {
+        kill(m_pid, SIGKILL);
+        waitpid(m_pid, nullptr, __WALL);
+        clear_threads();
+        throw std::runtime_error("No debug information for " + m.get_path());
+    }
+
+    // Addresses hit by file and line. Map nodes don't move, so sites can
+    // point at their counts.
+    std::map<std::string, std::map<unsigned, uint64_t>> files;
+    std::unordered_map<uint64_t, coverage_site> sites;
+
+    for (const dwarf::compilation_unit &cu : m.get_dwarf().compilation_units()) {
+        if (!sources.empty()) {
+            std::string name = cu.root().has(dwarf::DW_AT::name) ? at_name(cu.root()) : "";
+
+            if (std::none_of(sources.begin(), sources.end(), [&name](const std::string &source) {
+                    return name.find(source) != std::string::npos;
+                })) {
+                continue;
+            }
+        }
+
+        try {
+            for (const dwarf::line_table::entry &entry : cu.get_line_table()) {
+                uint64_t address = entry.address + m.get_bias();
+
+                if (!entry.is_stmt || entry.end_sequence || !entry.line || !m.contains(address) ||
+                    sites.count(address)) {
+                    continue;
+                }
+
+                uint64_t &hit_count = files[entry.file->path][entry.line];
+                sites.emplace(address, coverage_site {&hit_count, false});
+                m_breakpoint_sites.insert(address);
+            }
+        } catch (dwarf::format_error &) {
+            // No line table.
+        }
+    }
+
+    std::cout << std::dec << "Covering " << sites.size() << " addresses" << std::endl;
+
+    for (const auto &entry : m_threads) {
+        resume_thread(entry.first, PTRACE_CONT);
+    }
+
+    while (!m_threads.empty()) {
+        int wait_status;
+        pid_t tid = waitpid(-1, &wait_status, __WALL);
+
+        if (tid == -1) {
+            break;
         }
-    } else if (is_prefix(command, "memory")) {
-        std::string str {args[2], 2};
-        uint64_t address = std::stol(str, nullptr, 16);
 
-        if (is_prefix(args[1], "read")) {
-            std::cout << std::hex << read_memory(address) << std::endl;
-        } else if (is_prefix(args[1], "write")) {
-            std::string str {args[3], 2};
-            uint64_t value = std::stol(str, nullptr, 16);
-            write_memory(address, value);
+        if (handle_thread_event(tid, wait_status)) {
+            if (m_threads.count(tid)) {
+                resume_thread(tid, PTRACE_CONT);
+            }
+        } else if (WIFEXITED(wait_status) || WIFSIGNALED(wait_status)) {
+            clear_threads();
+        } else {
+            int signal = handle_coverage_stop(tid, wait_status, sites);
+            m_memory.flush();
+            resume_thread(tid, PTRACE_CONT, signal);
         }
-    } else if (is_prefix(command, "step")) {
-        step_in();
-    } else if (is_prefix(command, "stepi")) {
-        step_single_instruction_with_breakpoint_check();
-        dwarf::line_table::iterator line_entry = get_line_entry_from_pc(get_pc());
-        print_source(line_entry->file->path, line_entry->line);
-    } else if (is_prefix(command, "next")) {
-        step_over();
-    } else if (is_prefix(command, "finish")) {
-        step_out();
-    } else if (is_prefix(command, "symbol")) {
-        std::vector<symbol> symbols = lookup_symbol(args[1]);
+    }
 
-        for (symbol &sym : symbols) {
-            std::cout << sym.name << ' ' << to_string(sym.type)
-                      << " 0x" << std::hex << sym.address << std::endl;
+    std::ofstream lcov {output};
+    uint64_t n_lines = 0;
+    uint64_t n_lines_hit = 0;
+
+    for (const auto &file : files) {
+        uint64_t n_hit = 0;
+        lcov << "TN:\nSF:" << file.first << '\n';
+
+        for (const auto &line : file.second) {
+            lcov << "DA:" << line.first << ',' << (line.second > 0) << '\n';
+            n_hit += line.second > 0;
         }
-    } else if (is_prefix(command, "backtrace")) {
-        print_backtrace();
-    } else if (is_prefix(command, "variables")) {
-        read_variables();
-    } else {
-        std::cerr << "Unknown command" << std::endl;
+
+        lcov << "LF:" << file.second.size() << "\nLH:" << n_hit << "\nend_of_record\n";
+        n_lines += file.second.size();
+        n_lines_hit += n_hit;
     }
+
+    std::cout << std::dec << n_lines_hit << " of " << n_lines << " lines hit, written to "
+              << output << std::endl;
 }
 
-void debugger::continue_execution() {
-    step_over_breakpoint();
-    ptrace(PTRACE_CONT, m_pid, nullptr, nullptr);
-    wait_for_signal();
+// Counts a hit on a coverage breakpoint and queues its removal. A thread
+// can also stop at a breakpoint that another one has just removed, which
+// only needs moving back. Other stops are handled as when profiling.
+// Returns the signal to deliver when the thread is resumed.
+int debugger::handle_coverage_stop(pid_t tid, int status,
+                                   std::unordered_map<uint64_t, coverage_site> &sites) {
+    if (WSTOPSIG(status) == SIGTRAP) {
+        m_tid = tid;
+        m_registers = &m_threads.at(tid).registers;
+        siginfo_t info = get_signal_info();
+        auto it = sites.find(get_pc() - 1);
+
+        if ((info.si_code == TRAP_BRKPT || info.si_code == SI_KERNEL) && it != sites.end()) {
+            set_pc(it->first);
+
+            if (!it->second.removed) {
+                it->second.removed = true;
+                ++*it->second.hit_count;
+                m_breakpoint_sites.remove(it->first);
+            }
+
+            return 0;
+        }
+    }
+
+    return handle_profile_stop(tid, status);
 }
 
-void debugger::set_breakpoint_at_address(std::intptr_t address) {
-    breakpoint bp {m_pid, address};
+// Names the functions of a frame for reports. Return addresses are looked
+// up one byte back, since they can be just past the end of the caller.
+std::vector<std::string> debugger::get_frame_names(uint64_t pc, bool innermost) {
+    uint64_t address = innermost ? pc : pc - 1;
+
+    try {
+        return get_report_frames(get_module(address), address);
+    } catch (std::out_of_range &) {
+    }
+
+    std::stringstream stream;
+    stream << "0x" << std::hex << pc;
+    return {stream.str()};
+}
+
+siginfo_t debugger::get_signal_info() {
+    siginfo_t info;
+    ptrace(PTRACE_GETSIGINFO, m_tid, nullptr, &info);
+    return info;
+}
+
+void debugger::handle_sigtrap(siginfo_t info) {
+    switch (info.si_code) {
+        case SI_KERNEL:
+        case TRAP_BRKPT: {
+            uint64_t pc = get_pc() - 1;
+            set_pc(pc);
+
+            if (pc == m_loader_breakpoint) {
+                update_modules();
+                m_auto_resume = true;
+                return;
+            }
+
+            if (m_step_breakpoints.count(pc)) {
+                return;
+            }
+
+            auto it = m_breakpoints.find(pc);
+
+            if (it != m_breakpoints.end()) {
+                breakpoint &bp = it->second;
+
+                if (bp.get_condition() &&
+                    bp.get_condition()->evaluate(*m_registers, m_memory) == 0) {
+                    m_auto_resume = true;
+                    return;
+                }
+
+                if (!bp.hit()) {
+                    m_auto_resume = true;
+                    return;
+                }
+
+                if (bp.get_trace_format()) {
+                    if (m_trace_log.size() == max_trace_records) {
+                        m_trace_log.pop_front();
+                    }
+
+                    std::stringstream record;
+                    record << "0x" << std::hex << pc << std::dec << " #" << bp.get_hit_count()
+                           << ": " << bp.get_trace_format()->format(*m_registers, m_memory);
+                    m_trace_log.push_back(record.str());
+
+                    m_auto_resume = true;
+                    return;
+                }
+            }
+
+            std::cout << "Hit breakpoint at address 0x" << std::hex << pc << std::endl;
+            dwarf::line_table::iterator line_entry = get_line_entry_from_pc(pc);
+            print_source(line_entry->file->path, line_entry->line);
+            return;
+        }
+
+        case TRAP_HWBKPT: {
+            int slot = m_debug_registers.get_triggered(m_tid);
+            uint64_t pc = get_pc();
+
+            if (slot == -1) {
+                return;
+            }
+
+            if (m_debug_registers.get_condition(slot) == debug_condition::execute) {
+                std::cout << "Hit hardware breakpoint " << slot << " at address 0x"
+                          << std::hex << pc << std::endl;
+            } else {
+                uint64_t address = m_debug_registers.get_address(slot);
+                uint64_t value = 0;
+                read_memory(address, reinterpret_cast<uint8_t *>(&value),
+                            m_debug_registers.get_size(slot));
+                std::cout << "Hit watchpoint " << slot << " at address 0x" << std::hex
+                          << address << ", value = 0x" << value << std::endl;
+            }
+
+            dwarf::line_table::iterator line_entry = get_line_entry_from_pc(pc);
+            print_source(line_entry->file->path, line_entry->line);
+            return;
+        }
+
+        case TRAP_TRACE:
+            return;
+
+        default:
+            std::cout << "Unknown SIGTRAP code " << info.si_code << std::endl;
+            return;
+    }
+}
+
+std::vector<symbol> debugger::lookup_symbol(const std::string &name) {
+    std::vector<symbol> symbols;
+
+    for (const std::unique_ptr<module> &m : m_modules) {
+        for (symbol sym : m->get_symbols().search(name)) {
+            if (sym.address) {
+                sym.address += m->get_bias();
+            }
+
+            symbols.push_back(sym);
+        }
+    }
+
+    return symbols;
+}
+
+module &debugger::get_module(uint64_t address) {
+    for (const std::unique_ptr<module> &m : m_modules) {
+        if (m->contains(address)) {
+            return *m;
+        }
+    }
+
+    std::stringstream message;
+    message << "No module at address 0x" << std::hex << address;
+    throw std::out_of_range(message.str());
+}
+
+uint64_t debugger::get_auxv(uint64_t type) {
+    std::ifstream auxv {"/proc/" + std::to_string(m_pid) + "/auxv", std::ios::binary};
+    uint64_t entry[2];
+
+    while (auxv.read(reinterpret_cast<char *>(entry), sizeof(entry)) && entry[0] != AT_NULL) {
+        if (entry[0] == type) {
+            return entry[1];
+        }
+    }
+
+    return 0;
+}
+
+std::string debugger::read_string(uint64_t address) {
+    std::string str;
+    char c;
+
+    while (true) {
+        read_memory(address++, reinterpret_cast<uint8_t *>(&c), 1);
+
+        if (c == '\0') {
+            return str;
+        }
+
+        str.push_back(c);
+    }
+}
+
+// Works out where the executable was loaded from its entry point, and
+// stops in the dynamic linker's _dl_debug_state, which it calls whenever
+// the list of loaded objects changes.
+void debugger::load_modules() {
+    module &program = *m_modules.front();
+    program.set_bias(get_auxv(AT_ENTRY) - program.get_elf().get_hdr().entry);
+
+    std::string interpreter;
+
+    for (const elf::segment &segment : program.get_elf().segments()) {
+        if (segment.get_hdr().type == elf::pt::interp) {
+            interpreter = static_cast<const char *>(segment.data());
+        }
+    }
+
+    // Statically linked.
+    if (interpreter.empty()) {
+        return;
+    }
+
+    m_modules.emplace_back(new module {interpreter, get_auxv(AT_BASE)});
+    module &loader = *m_modules.back();
+
+    for (const symbol &sym : loader.get_symbols().search("_dl_debug_state")) {
+        m_loader_breakpoint = sym.address + loader.get_bias();
+    }
+
+    for (const symbol &sym : loader.get_symbols().search("_r_debug")) {
+        m_r_debug = sym.address + loader.get_bias();
+    }
+
+    if (!m_loader_breakpoint || !m_r_debug) {
+        std::cerr << "Dynamic linker has no debug interface; shared libraries are not tracked"
+                  << std::endl;
+        return;
+    }
+
+    breakpoint bp {m_breakpoint_sites, static_cast<std::intptr_t>(m_loader_breakpoint)};
     bp.enable();
-    m_breakpoints.emplace(address, bp);
-    std::cout << "Set breakpoint at address 0x" << std::hex << address << std::endl;
+    m_breakpoints.emplace(m_loader_breakpoint, bp);
+
+    update_modules();
+}
+
+// Brings the modules in line with the dynamic linker's list of loaded
+// objects. New modules are only opened here; see module.
+void debugger::update_modules() {
+    r_debug debug;
+    read_memory(m_r_debug, reinterpret_cast<uint8_t *>(&debug), sizeof(debug));
+
+    if (debug.r_state != r_debug::RT_CONSISTENT) {
+        return;
+    }
+
+    std::set<std::pair<std::string, uint64_t>> loaded;
+
+    for (uint64_t address = reinterpret_cast<uint64_t>(debug.r_map); address;) {
+        link_map map;
+        read_memory(address, reinterpret_cast<uint8_t *>(&map), sizeof(map));
+        address = reinterpret_cast<uint64_t>(map.l_next);
+
+        std::string path = map.l_name ? read_string(reinterpret_cast<uint64_t>(map.l_name)) : "";
+
+        // The executable and the vDSO have no file to load.
+        if (path.empty() || access(path.c_str(), R_OK) != 0) {
+            continue;
+        }
+
+        loaded.emplace(path, map.l_addr);
+
+        bool known = std::any_of(m_modules.begin(), m_modules.end(), [&](auto &&m) {
+            return m->get_path() == path && m->get_bias() == map.l_addr;
+        });
+
+        if (!known) {
+            try {
+                m_modules.emplace_back(new module {path, map.l_addr});
+            } catch (std::exception &e) {
+                std::cerr << e.what() << std::endl;
+            }
+        }
+    }
+
+    // The executable and the dynamic linker stay.
+    auto unloaded = std::stable_partition(
+        m_modules.begin() + std::min<std::size_t>(2, m_modules.size()), m_modules.end(),
+        [&loaded](auto &&m) { return loaded.count({m->get_path(), m->get_bias()}) > 0; });
+
+    for (auto it = unloaded; it != m_modules.end(); it++) {
+        drop_breakpoints(**it);
+    }
+
+    m_modules.erase(unloaded, m_modules.end());
+}
+
+// Forgets the breakpoints, tracepoints and debug registers in a module that
+// has been unloaded. Its code is gone, so nothing is written back, and
+// conditions and log formats refer to its debug information.
+void debugger::drop_breakpoints(const module &m) {
+    for (auto it = m_breakpoints.begin(); it != m_breakpoints.end();) {
+        uint64_t address = it->first;
+
+        if (!m.contains(address)) {
+            it++;
+            continue;
+        }
+
+        if (!m_step_breakpoints.erase(address)) {
+            std::cout << "Removed breakpoint at address 0x" << std::hex << address
+                      << " in unloaded " << m.get_path() << std::endl;
+        }
+
+        m_breakpoint_sites.forget(address);
+        it = m_breakpoints.erase(it);
+    }
+
+    for (auto it = m_fast_tracepoints.begin(); it != m_fast_tracepoints.end();) {
+        if (m.contains(it->first)) {
+            std::cout << "Removed fast tracepoint at address 0x" << std::hex << it->first
+                      << " in unloaded " << m.get_path() << std::endl;
+            it = m_fast_tracepoints.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    for (std::size_t slot = 0; slot < n_debug_slots; slot++) {
+        if (m_debug_registers.is_used(slot) && m.contains(m_debug_registers.get_address(slot))) {
+            std::cout << "Removed debug register " << std::dec << slot << " in unloaded "
+                      << m.get_path() << std::endl;
+            m_debug_registers.remove(slot);
+        }
+    }
 }
 
-void debugger::set_breakpoint_at_function(const std::string &name) {
-    for (const dwarf::compilation_unit &cu : m_dwarf.compilation_units()) {
-        for (const dwarf::die &die : cu.root()) {
-            if (die.has(dwarf::DW_AT::name) && at_name(die) == name) {
-                dwarf::taddr low_pc = at_low_pc(die);
-                dwarf::line_table::iterator entry = get_line_entry_from_pc(low_pc);
-                entry++; // Skip prologue.
-                set_breakpoint_at_address(entry->address);
+void debugger::read_variables() {
+    dwarf::die func = get_function_from_pc(get_pc());
+
+    for (const dwarf::die &die : func) {
+        if (die.tag != dwarf::DW_TAG::variable) {
+            continue;
+        }
+
+        dwarf::value loc_val = die[dwarf::DW_AT::location];
+
+        if (loc_val.get_type() != dwarf::value::type::exprloc) {
+            continue;
+        }
+
+        ptrace_expr_context context {*m_registers, m_memory};
+        dwarf::expr_result result = loc_val.as_exprloc().evaluate(&context);
+
+        switch (result.location_type) {
+            case dwarf::expr_result::type::address: {
+                uint64_t address = result.value;
+
+                if (is_static_location(loc_val)) {
+                    address += get_module(get_pc()).get_bias();
+                }
+
+                uint64_t value = read_memory(address);
+                std::cout << at_name(die) << " (0x" << std::hex << address << ") = "
+                          << value << std::endl;
+                break;
+            }
+
+            case dwarf::expr_result::type::reg: {
+                uint64_t value =
+                    get_register_value_from_dwarf_register(m_registers->get(), result.value);
+                std::cout << at_name(die) << " (reg " << result.value << ") = "
+                          << value << std::endl;
+                break;
             }
+
+            default:
+                throw std::runtime_error("Unhandled variable location");
         }
     }
 }
 
-void debugger::set_breakpoint_at_line(const std::string &file, unsigned line) {
-    for (const dwarf::compilation_unit &cu : m_dwarf.compilation_units()) {
-        if (is_suffix(file, at_name(cu.root()))) {
-            const dwarf::line_table &lt = cu.get_line_table();
+// The user registers sampled with each perf event, by perf register
+// number, which is the order the kernel writes them in, with the DWARF
+// number of each. The instruction pointer becomes the frame's pc.
+const std::array<std::pair<int, int>, 17> perf_registers {{
+    {PERF_REG_X86_AX, 0},  {PERF_REG_X86_BX, 3},   {PERF_REG_X86_CX, 2},
+    {PERF_REG_X86_DX, 1},  {PERF_REG_X86_SI, 4},   {PERF_REG_X86_DI, 5},
+    {PERF_REG_X86_BP, 6},  {PERF_REG_X86_SP, 7},   {PERF_REG_X86_IP, cfi_return_address},
+    {PERF_REG_X86_R8, 8},  {PERF_REG_X86_R9, 9},   {PERF_REG_X86_R10, 10},
+    {PERF_REG_X86_R11, 11}, {PERF_REG_X86_R12, 12}, {PERF_REG_X86_R13, 13},
+    {PERF_REG_X86_R14, 14}, {PERF_REG_X86_R15, 15},
+}};
+
+// Bytes of user stack copied with each sample, and data pages in each
+// ring buffer. 128 pages per CPU fits the default perf_event_mlock_kb.
+const uint32_t perf_stack_size = 16384;
+const std::size_t perf_ring_pages = 128;
+
+// Samples a program with perf events rather than ptrace, so it never stops.
+// The kernel copies the registers and the top of the user stack into a
+// ring buffer with each sample, and the stacks are unwound from the copies
+// with each module's CFI. Modules are found from the mmap records in the
+// same buffers, since the process may be gone by the time names are looked
+// up for the report.
+class perf_profiler {
+public:
+    perf_profiler(char **args) : m_args{args}, m_n_samples{0}, m_n_lost{0} {}
+    ~perf_profiler();
+
+    void run(unsigned hz, std::size_t top_n, const std::string &output);
+
+private:
+    struct ring {
+        int fd;
+        char *base;
+    };
+
+    void open_events(pid_t pid, unsigned hz);
+    void drain(ring &r);
+    void handle_sample(const char *data, std::size_t size);
+    void handle_mmap(const char *data, std::size_t size);
+    module *get_module(uint64_t address);
+
+    char **m_args;
+    std::vector<ring> m_rings;
+    std::vector<std::unique_ptr<module>> m_modules;
+    std::map<std::vector<uint64_t>, uint64_t> m_samples;
+    uint64_t m_n_samples;
+    uint64_t m_n_lost;
+};
+
+perf_profiler::~perf_profiler() {
+    for (ring &r : m_rings) {
+        munmap(r.base, (perf_ring_pages + 1) * page_size);
+        close(r.fd);
+    }
+}
+
+// Starts the program and samples it hz times a second until it exits. The
+// child waits on a pipe until the events are open; they are enabled when
+// it execs, so the samples start with the program itself.
+void perf_profiler::run(unsigned hz, std::size_t top_n, const std::string &output) {
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        throw std::runtime_error("Cannot create pipe");
+    }
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        char go;
+        close(fds[1]);
+
+        if (read(fds[0], &go, 1) == 1) {
+            execv(m_args[0], m_args);
+        }
+
+        _exit(127);
+    }
+
+    close(fds[0]);
+
+    if (pid == -1) {
+        close(fds[1]);
+        throw std::runtime_error("Program failed to start");
+    }
+
+    try {
+        open_events(pid, hz);
+    } catch (std::exception &) {
+        close(fds[1]);
+        waitpid(pid, nullptr, 0);
+        throw;
+    }
+
+    char go = 0;
+
+    if (write(fds[1], &go, 1) != 1) {
+        close(fds[1]);
+        waitpid(pid, nullptr, 0);
+        throw std::runtime_error("Program failed to start");
+    }
+
+    close(fds[1]);
+
+    std::vector<pollfd> polls;
+
+    for (const ring &r : m_rings) {
+        polls.push_back(pollfd {r.fd, POLLIN, 0});
+    }
+
+    for (bool exited = false; !exited;) {
+        poll(polls.data(), polls.size(), 100);
+        exited = waitpid(pid, nullptr, WNOHANG) == pid;
 
-            for (const dwarf::line_table::entry &entry : lt) {
-                if (entry.is_stmt && entry.line == line) {
-                    set_breakpoint_at_address(entry.address);
-                    return;
-                }
-            }
+        for (ring &r : m_rings) {
+            drain(r);
         }
     }
-}
 
-void debugger::remove_breakpoint(std::intptr_t address) {
-    if (m_breakpoints.at(address).is_enabled()) {
-        m_breakpoints.at(address).disable();
+    if (m_n_lost) {
+        std::cerr << std::dec << m_n_lost << " samples lost" << std::endl;
     }
 
-    m_breakpoints.erase(address);
+    write_profile(m_samples, m_n_samples, top_n, output, [this](uint64_t pc, bool innermost) {
+        uint64_t address = innermost ? pc : pc - 1;
+        module *m = get_module(address);
+
+        if (m) {
+            return get_report_frames(*m, address);
+        }
+
+        std::stringstream stream;
+        stream << "0x" << std::hex << pc;
+        return std::vector<std::string> {stream.str()};
+    });
 }
 
-void debugger::dump_registers() {
-    for (const reg_descriptor &rd : g_register_descriptors) {
-        std::cout << std::left << std::setfill(' ') << std::setw(8) << rd.name
-                  << " 0x" << std::right << std::setfill('0') << std::setw(16)
-                  << std::hex << get_register_value(m_pid, rd.r) << std::endl;
+// Opens a user-space CPU clock event for the process on each CPU, each with
+// its own ring buffer. Events are inherited by new threads.
+void perf_profiler::open_events(pid_t pid, unsigned hz) {
+    perf_event_attr attr {};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_CPU_CLOCK;
+    attr.freq = 1;
+    attr.sample_freq = hz;
+    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN |
+                       PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+    attr.sample_stack_user = perf_stack_size;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.enable_on_exec = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.exclude_callchain_kernel = 1;
+    attr.mmap = 1;
+
+    for (const auto &reg : perf_registers) {
+        attr.sample_regs_user |= uint64_t {1} << reg.first;
     }
-}
 
-uint64_t debugger::read_memory(uint64_t address) {
-    return ptrace(PTRACE_PEEKDATA, m_pid, address, nullptr);
-}
+    long n_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    int error = 0;
 
-void debugger::write_memory(uint64_t address, uint64_t value) {
-    ptrace(PTRACE_POKEDATA, m_pid, address, value);
-}
+    for (int cpu = 0; cpu < n_cpus; cpu++) {
+        int fd = syscall(SYS_perf_event_open, &attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
 
-uint64_t debugger::get_pc() {
-    return get_register_value(m_pid, reg::rip);
-}
+        if (fd == -1) {
+            // Offline CPUs can't be opened; skip them.
+            error = errno;
+            continue;
+        }
 
-void debugger::set_pc(uint64_t pc) {
-    set_register_value(m_pid, reg::rip, pc);
-}
+        void *base = mmap(nullptr, (perf_ring_pages + 1) * page_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
 
-void debugger::step_single_instruction() {
-    ptrace(PTRACE_SINGLESTEP, m_pid, nullptr, nullptr);
-    wait_for_signal();
-}
+        if (base == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error(std::string {"Cannot map perf buffer: "} +
+                                     std::strerror(errno));
+        }
 
-void debugger::step_single_instruction_with_breakpoint_check() {
-    if (m_breakpoints.count(get_pc())) {
-        step_over_breakpoint();
-    } else {
-        step_single_instruction();
+        m_rings.push_back(ring {fd, static_cast<char *>(base)});
+    }
+
+    if (m_rings.empty()) {
+        throw std::runtime_error(std::string {"Cannot open perf events: "} +
+                                 std::strerror(error));
     }
 }
 
-void debugger::step_over_breakpoint() {
-    uint64_t pc = get_pc();
+// Handles every record in a ring buffer, then hands the space back.
+void perf_profiler::drain(ring &r) {
+    std::size_t data_size = perf_ring_pages * page_size;
+    auto *page = reinterpret_cast<perf_event_mmap_page *>(r.base);
+    const char *data = r.base + page_size;
+
+    uint64_t head = __atomic_load_n(&page->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = page->data_tail;
+
+    // Records can wrap around the end of the buffer.
+    auto copy = [&](uint64_t position, void *out, std::size_t size) {
+        std::size_t offset = position % data_size;
+        std::size_t first = std::min(size, data_size - offset);
+        std::memcpy(out, data + offset, first);
+        std::memcpy(static_cast<char *>(out) + first, data, size - first);
+    };
 
-    if (m_breakpoints.count(pc)) {
-        breakpoint &bp = m_breakpoints.at(pc);
+    std::vector<char> record;
 
-        if (bp.is_enabled()) {
-            bp.disable();
-            step_single_instruction();
-            bp.enable();
+    while (tail < head) {
+        perf_event_header header;
+        copy(tail, &header, sizeof(header));
+
+        if (header.size < sizeof(header)) {
+            break;
         }
-    }
-}
 
-void debugger::step_in() {
-    unsigned line = get_line_entry_from_pc(get_pc())->line;
+        record.resize(header.size - sizeof(header));
+        copy(tail + sizeof(header), record.data(), record.size());
 
-    while (get_line_entry_from_pc(get_pc())->line == line) {
-        step_single_instruction_with_breakpoint_check();
+        switch (header.type) {
+            case PERF_RECORD_SAMPLE:
+                handle_sample(record.data(), record.size());
+                break;
+            case PERF_RECORD_MMAP:
+                handle_mmap(record.data(), record.size());
+                break;
+            case PERF_RECORD_LOST: {
+                uint64_t lost;
+                std::memcpy(&lost, record.data() + sizeof(uint64_t), sizeof(lost));
+                m_n_lost += lost;
+                break;
+            }
+        }
+
+        tail += header.size;
     }
 
-    dwarf::line_table::iterator line_entry = get_line_entry_from_pc(get_pc());
-    print_source(line_entry->file->path, line_entry->line);
+    __atomic_store_n(&page->data_tail, tail, __ATOMIC_RELEASE);
 }
 
-void debugger::step_over() {
-    dwarf::die func = get_function_from_pc(get_pc());
-    dwarf::taddr func_entry = at_low_pc(func);
-    dwarf::taddr func_end = at_high_pc(func);
+// Unwinds a sample from its copy of the registers and stack. The kernel's
+// frame pointer chain is used instead when it gets further, which is the
+// case when the stack copy is cut short or a module can't be found.
+void perf_profiler::handle_sample(const char *data, std::size_t size) {
+    const std::size_t max_depth = 1024;
+    std::size_t offset = 0;
 
-    dwarf::line_table::iterator line = get_line_entry_from_pc(func_entry);
-    dwarf::line_table::iterator start_line = get_line_entry_from_pc(get_pc());
+    auto next = [&]() {
+        uint64_t value = 0;
 
-    std::vector<std::intptr_t> to_delete {};
+        if (offset + sizeof(value) <= size) {
+            std::memcpy(&value, data + offset, sizeof(value));
+        }
 
-    while (line->address < func_end) {
-        auto address = line->address;
+        offset += sizeof(value);
+        return value;
+    };
 
-        if (address != start_line->address && !m_breakpoints.count(address)) {
-            set_breakpoint_at_address(address);
-            to_delete.push_back(address);
+    uint64_t ip = next();
+    next(); // pid and tid
+
+    std::vector<uint64_t> callchain;
+    uint64_t n_callchain = next();
+
+    for (uint64_t i = 0; i < n_callchain; i++) {
+        uint64_t pc = next();
+
+        // Context markers, such as PERF_CONTEXT_USER, aren't addresses.
+        if (pc < static_cast<uint64_t>(PERF_CONTEXT_MAX) && callchain.size() < max_depth) {
+            callchain.push_back(pc);
+        }
+    }
+
+    unwind_frame frame {ip, {}, 0};
+
+    if (next() != PERF_SAMPLE_REGS_ABI_NONE) {
+        for (const auto &reg : perf_registers) {
+            uint64_t value = next();
+
+            if (reg.second != cfi_return_address) {
+                frame.regs[reg.second] = value;
+                frame.valid |= 1u << reg.second;
+            }
         }
+    }
 
-        line++;
+    uint64_t stack_size = next();
+    const char *stack = data + std::min(offset, size);
+    offset += stack_size;
+    uint64_t dynamic_size = stack_size ? next() : 0;
+    uint64_t sp = frame.regs[cfi_rsp];
+
+    if (offset > size) {
+        dynamic_size = 0;
     }
 
-    uint64_t frame_pointer = get_register_value(m_pid, reg::rbp);
-    uint64_t return_address = read_memory(frame_pointer + sizeof(uint64_t));
+    std::vector<uint64_t> stack_trace;
+
+    if (frame.valid) {
+        auto read = [&](uint64_t address, uint64_t &value) {
+            if (address < sp || address - sp + sizeof(value) > dynamic_size) {
+                return false;
+            }
+
+            std::memcpy(&value, stack + (address - sp), sizeof(value));
+            return true;
+        };
 
-    if (!m_breakpoints.count(return_address)) {
-        set_breakpoint_at_address(return_address);
-        to_delete.push_back(return_address);
+        do {
+            stack_trace.push_back(frame.pc);
+        } while (stack_trace.size() < max_depth &&
+                 unwind_caller(frame, stack_trace.size() == 1, get_module(frame.pc), read));
     }
 
-    continue_execution();
+    if (callchain.size() > stack_trace.size()) {
+        stack_trace = callchain;
+    }
 
-    for (auto address : to_delete) {
-        remove_breakpoint(address);
+    if (stack_trace.empty()) {
+        stack_trace.push_back(ip);
     }
+
+    m_samples[stack_trace]++;
+    m_n_samples++;
 }
 
-void debugger::step_out() {
-    uint64_t frame_pointer = get_register_value(m_pid, reg::rbp);
-    uint64_t return_address = read_memory(frame_pointer + sizeof(uint64_t));
+// Adds the module of an executable mapping. The bias comes from the
+// loadable segment holding the mapped file offset.
+// Works out the load bias of an ELF file from one of its mappings, with
+// file_offset mapped at address. Returns false if no loadable segment
+// covers the offset.
+bool get_mapping_bias(const elf::elf &f, uint64_t address, uint64_t file_offset,
+                      uint64_t &bias) {
+    for (const elf::segment &segment : f.segments()) {
+        const elf::Phdr<> &hdr = segment.get_hdr();
+
+        if (hdr.type == elf::pt::load && file_offset >= (hdr.offset & ~(page_size - 1)) &&
+            file_offset < hdr.offset + hdr.filesz) {
+            bias = address - hdr.vaddr - file_offset + hdr.offset;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void perf_profiler::handle_mmap(const char *data, std::size_t size) {
+    const std::size_t path_offset = 2 * sizeof(uint32_t) + 3 * sizeof(uint64_t);
 
-    bool should_remove_breakpoint = false;
-    if (!m_breakpoints.count(return_address)) {
-        set_breakpoint_at_address(return_address);
-        should_remove_breakpoint = true;
+    if (size <= path_offset) {
+        return;
     }
 
-    continue_execution();
+    uint64_t address;
+    uint64_t file_offset;
+    std::memcpy(&address, data + 2 * sizeof(uint32_t), sizeof(address));
+    std::memcpy(&file_offset, data + 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t),
+                sizeof(file_offset));
+    std::string path {data + path_offset, strnlen(data + path_offset, size - path_offset)};
 
-    if (should_remove_breakpoint) {
-        remove_breakpoint(return_address);
+    // Anonymous and special mappings, such as [vdso], have no file.
+    if (path.empty() || path[0] != '/') {
+        return;
     }
-}
 
-void debugger::wait_for_signal() {
-    int wait_status;
-    int options = 0;
-    waitpid(m_pid, &wait_status, options);
+    // Every segment of a file gets its own record, so the file is usually
+    // open already.
+    for (const auto &known : m_modules) {
+        uint64_t bias;
 
-    siginfo_t info = get_signal_info();
+        if (known->get_path() == path &&
+            get_mapping_bias(known->get_elf(), address, file_offset, bias) &&
+            bias == known->get_bias()) {
+            return;
+        }
+    }
 
-    switch (info.si_signo) {
-        case SIGTRAP:
-            handle_sigtrap(info);
-            break;
+    try {
+        std::unique_ptr<module> m {new module {path, 0}};
+        uint64_t bias;
 
-        case SIGSEGV:
-            std::cout << "Segmentation fault. Reason: " << info.si_code << std::endl;
-            break;
+        if (get_mapping_bias(m->get_elf(), address, file_offset, bias)) {
+            m->set_bias(bias);
+        }
 
-        default:
-            std::cout << "Got signal: " << strsignal(info.si_signo) << std::endl;
-            break;
+        m_modules.push_back(std::move(m));
+    } catch (std::exception &) {
+        // The file is gone or isn't ELF; its frames are named by address.
     }
 }
 
-dwarf::die debugger::get_function_from_pc(uint64_t pc) {
-    for (const dwarf::compilation_unit &cu : m_dwarf.compilation_units()) {
-        if (!die_pc_range(cu.root()).contains(pc)) {
-            continue;
+module *perf_profiler::get_module(uint64_t address) {
+    for (const auto &m : m_modules) {
+        if (m->contains(address)) {
+            return m.get();
         }
+    }
 
-        for (const dwarf::die &die : cu.root()) {
-            if (die.tag != dwarf::DW_TAG::subprogram) {
-                continue;
+    return nullptr;
+}
+
+// Reads a hex file address from each line of standard input, and writes a
+// "function file:line" line for each of its frames, innermost first,
+// followed by an empty line. Input is read in large blocks, and the lines
+// of each block are split between threads that format into their own
+// buffers, which are written out in order.
+void symbolize_batch(const symbolizer &s) {
+    const std::size_t block_size = 1 << 24;
+    unsigned n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<char> buffer(block_size);
+    std::string block;
+    std::vector<std::string> outputs(n_threads);
+
+    auto symbolize_lines = [&s](const char *begin, const char *end, std::string &out) {
+        std::vector<symbolizer::frame> frames;
+
+        while (begin < end) {
+            const char *newline = static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+            const char *line_end = newline ? newline : end;
+            const char *p = begin;
+
+            while (p < line_end && std::isspace(static_cast<unsigned char>(*p))) {
+                p++;
             }
 
-            if (!die_pc_range(die).contains(pc)) {
-                continue;
+            if (p < line_end) {
+                // Only the last line of the input can lack a newline, and
+                // the block's terminator stops the parse there.
+                char *parsed;
+                uint64_t address = std::strtoull(p, &parsed, 16);
+                frames.clear();
+
+                if (parsed != p) {
+                    s.symbolize(address, frames);
+                }
+
+                if (frames.empty()) {
+                    out += "?? ??:0\n";
+                }
+
+                for (const symbolizer::frame &frame : frames) {
+                    if (frame.function->empty()) {
+                        out += "??";
+                    } else {
+                        out += *frame.function;
+                    }
+
+                    out += ' ';
+
+                    if (frame.file->empty()) {
+                        out += "??";
+                    } else {
+                        out += *frame.file;
+                    }
+
+                    out += ':';
+                    out += std::to_string(frame.line);
+                    out += '\n';
+                }
+
+                out += '\n';
             }
 
-            return die;
+            begin = line_end + 1;
         }
-    }
+    };
 
-    throw std::out_of_range("Unknown function");
-}
+    for (bool done = false; !done;) {
+        std::size_t n = std::fread(buffer.data(), 1, buffer.size(), stdin);
+        done = n < buffer.size();
+        block.append(buffer.data(), n);
 
-dwarf::line_table::iterator debugger::get_line_entry_from_pc(uint64_t pc) {
-    for (const dwarf::compilation_unit &cu : m_dwarf.compilation_units()) {
-        if (!die_pc_range(cu.root()).contains(pc)) {
-            continue;
-        }
+        // Leave a partial last line for the next block.
+        std::size_t end = done ? block.size() : block.rfind('\n') + 1;
 
-        const dwarf::line_table &lt = cu.get_line_table();
-        dwarf::line_table::iterator it = lt.find_address(pc);
+        std::vector<std::size_t> bounds {0};
 
-        if (it == lt.end()) {
-            throw std::out_of_range("Unknown line entry");
+        for (unsigned t = 1; t < n_threads; t++) {
+            std::size_t bound = std::max(bounds.back(), end / n_threads * t);
+            bound = block.find('\n', bound);
+            bounds.push_back(bound == std::string::npos || bound >= end ? end : bound + 1);
         }
 
-        return it;
-    }
+        bounds.push_back(end);
 
-    throw std::out_of_range("Unknown line entry");
-}
+        std::vector<std::thread> threads;
 
-void debugger::print_source(const std::string &filename, unsigned line, unsigned n_lines_context) {
-    std::ifstream file {filename};
+        for (unsigned t = 0; t < n_threads; t++) {
+            outputs[t].clear();
 
-    unsigned start_line = line <= n_lines_context ? 1 : line - n_lines_context;
-    unsigned end_line = line + n_lines_context + 1 +
-                        (line < n_lines_context ? n_lines_context - line : 0);
+            if (bounds[t] < bounds[t + 1]) {
+                threads.emplace_back(symbolize_lines, block.data() + bounds[t],
+                                     block.data() + bounds[t + 1], std::ref(outputs[t]));
+            }
+        }
 
-    char c {};
-    unsigned current_line = 1;
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
 
-    while (current_line != start_line && file.get(c)) {
-        if (c == '\n') {
-            current_line++;
+        for (const std::string &output : outputs) {
+            std::fwrite(output.data(), 1, output.size(), stdout);
         }
+
+        block.erase(0, end);
     }
 
-    std::cout << (current_line == line ? "> " : "  ");
+    std::fflush(stdout);
+}
 
-    while (current_line != end_line && file.get(c)) {
-        std::cout << c;
+// Starts a traced program, which stops when it execs. Returns -1 on failure.
+pid_t launch(char **args) {
+    pid_t pid = fork();
 
-        if (c == '\n') {
-            current_line++;
-            std::cout << (current_line == line ? "> " : "  ");
-        }
+    if (pid == 0) {
+        ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+        execv(args[0], args);
+        _exit(127);
     }
 
-    std::cout << std::endl;
+    return pid;
 }
 
-void debugger::print_backtrace() {
-    auto print_frame = [frame_number = 0](dwarf::die &func) mutable {
-        std::cout << "frame #" << frame_number << ": 0x" << dwarf::at_low_pc(func)
-                  << ' ' << dwarf::at_name(func) << std::endl;
-        frame_number++;
-    };
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Program name not specified" << std::endl;
+        return -1;
+    }
 
-    dwarf::die current_func = get_function_from_pc(get_pc());
-    print_frame(current_func);
+    if (std::string {argv[1]} == "-p") {
+        if (argc < 3) {
+            std::cerr << "PID not specified" << std::endl;
+            return -1;
+        }
 
-    uint64_t frame_pointer = get_register_value(m_pid, reg::rbp);
-    uint64_t return_address = read_memory(frame_pointer + sizeof(uint64_t));
+        pid_t pid = std::stoi(argv[2]);
 
-    while (dwarf::at_name(current_func) != "main") {
-        current_func = get_function_from_pc(return_address);
-        print_frame(current_func);
-        frame_pointer = read_memory(frame_pointer);
-        return_address = read_memory(frame_pointer + sizeof(uint64_t));
-    }
-}
+        // Prefer the real path, which keys the index cache, unless the
+        // file has been replaced since the process started.
+        std::string exe = "/proc/" + std::to_string(pid) + "/exe";
+        char path[PATH_MAX];
+        ssize_t length = readlink(exe.c_str(), path, sizeof(path) - 1);
 
-siginfo_t debugger::get_signal_info() {
-    siginfo_t info;
-    ptrace(PTRACE_GETSIGINFO, m_pid, nullptr, &info);
-    return info;
-}
+        if (length > 0) {
+            path[length] = '\0';
 
-void debugger::handle_sigtrap(siginfo_t info) {
-    switch (info.si_code) {
-        case SI_KERNEL:
-        case TRAP_BRKPT: {
-            uint64_t pc = get_pc() - 1;
-            set_pc(pc);
-            std::cout << "Hit breakpoint at address 0x" << std::hex << pc << std::endl;
-            dwarf::line_table::iterator line_entry = get_line_entry_from_pc(pc);
-            print_source(line_entry->file->path, line_entry->line);
-            return;
+            if (access(path, R_OK) == 0) {
+                exe = path;
+            }
         }
 
-        case TRAP_TRACE:
-            return;
+        try {
+            debugger dbg{exe, pid};
+            dbg.attach();
+            dbg.run();
+        } catch (std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
 
-        default:
-            std::cout << "Unknown SIGTRAP code " << info.si_code << std::endl;
-            return;
+        return 0;
     }
-}
-
-std::vector<symbol> debugger::lookup_symbol(const std::string &name) {
-    std::vector<symbol> symbols;
-
-    for (const elf::section &section : m_elf.sections()) {
-        elf::sht type = section.get_hdr().type;
 
-        if (type != elf::sht::symtab && type != elf::sht::dynsym) {
-            continue;
+    if (std::string {argv[1]} == "symbolize") {
+        if (argc < 3) {
+            std::cerr << "Usage: dbg symbolize <binary> < addresses" << std::endl;
+            return -1;
         }
 
-        for (elf::sym sym : section.as_symtab()) {
-            if (sym.get_name() == name) {
-                const elf::Sym<> &data = sym.get_data();
-                symbol_type st = to_symbol_type(data.type());
-                symbols.push_back(symbol {st, sym.get_name(), data.value});
-            }
+        try {
+            module m {argv[2], 0};
+            symbolizer s {m};
+            symbolize_batch(s);
+        } catch (std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
         }
+
+        return 0;
     }
 
-    return symbols;
-}
+    if (std::string {argv[1]} == "coverage") {
+        std::vector<std::string> sources;
+        std::string output = "coverage.info";
+        int i = 2;
 
-void debugger::read_variables() {
-    dwarf::die func = get_function_from_pc(get_pc());
+        for (; i < argc && argv[i][0] == '-'; i++) {
+            std::string option = argv[i];
 
-    for (const dwarf::die &die : func) {
-        if (die.tag != dwarf::DW_TAG::variable) {
-            continue;
+            if (option != "--source" && option != "-o") {
+                std::cerr << "Unknown option " << option << std::endl;
+                return -1;
+            }
+
+            if (i + 1 == argc) {
+                std::cerr << "Option " << option << " needs a value" << std::endl;
+                return -1;
+            }
+
+            std::string value = argv[++i];
+
+            if (option == "--source") {
+                sources.push_back(value);
+            } else {
+                output = value;
+            }
         }
 
-        dwarf::value loc_val = die[dwarf::DW_AT::location];
+        if (i >= argc) {
+            std::cerr << "Usage: dbg coverage [--source pattern] [-o file] <prog> [args]"
+                      << std::endl;
+            return -1;
+        }
 
-        if (loc_val.get_type() != dwarf::value::type::exprloc) {
-            continue;
+        pid_t pid = launch(argv + i);
+
+        if (pid == -1) {
+            std::cerr << "Program failed to start" << std::endl;
+            return -1;
         }
 
-        ptrace_expr_context context {m_pid};
-        dwarf::expr_result result = loc_val.as_exprloc().evaluate(&context);
+        try {
+            debugger dbg{argv[i], pid};
+            dbg.coverage(sources, output);
+        } catch (std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
 
-        switch (result.location_type) {
-            case dwarf::expr_result::type::address: {
-                uint64_t value = read_memory(result.value);
-                std::cout << at_name(die) << " (0x" << std::hex << result.value << ") = "
-                          << value << std::endl;
-                break;
+        return 0;
+    }
+
+    if (std::string {argv[1]} == "profile") {
+        unsigned hz = 99;
+        std::size_t top_n = 20;
+        std::string output = "profile.folded";
+        bool use_perf = false;
+        int i = 2;
+
+        for (; i < argc && argv[i][0] == '-'; i++) {
+            std::string option = argv[i];
+
+            if (option == "--perf") {
+                use_perf = true;
+                continue;
             }
 
-            case dwarf::expr_result::type::reg: {
-                uint64_t value = get_register_value_from_dwarf_register(m_pid, result.value);
-                std::cout << at_name(die) << " (reg " << result.value << ") = "
-                          << value << std::endl;
-                break;
+            if (option != "--hz" && option != "--top" && option != "-o") {
+                std::cerr << "Unknown option " << option << std::endl;
+                return -1;
             }
 
-            default:
-                throw std::runtime_error("Unhandled variable location");
+            if (i + 1 == argc) {
+                std::cerr << "Option " << option << " needs a value" << std::endl;
+                return -1;
+            }
+
+            std::string value = argv[++i];
+
+            if (option == "--hz") {
+                hz = std::stoul(value);
+            } else if (option == "--top") {
+                top_n = std::stoul(value);
+            } else {
+                output = value;
+            }
         }
-    }
-}
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        std::cerr << "Program name not specified" << std::endl;
-        return -1;
+        if (i >= argc || hz == 0) {
+            std::cerr << "Usage: dbg profile [--perf] [--hz N] [--top N] [-o file] <prog> [args]"
+                      << std::endl;
+            return -1;
+        }
+
+        if (use_perf) {
+            try {
+                perf_profiler profiler{argv + i};
+                profiler.run(hz, top_n, output);
+            } catch (std::exception &e) {
+                std::cerr << e.what() << std::endl;
+                return -1;
+            }
+
+            return 0;
+        }
+
+        pid_t pid = launch(argv + i);
+
+        if (pid == -1) {
+            std::cerr << "Program failed to start" << std::endl;
+            return -1;
+        }
+
+        try {
+            debugger dbg{argv[i], pid};
+            dbg.profile(hz, top_n, output);
+        } catch (std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
+
+        return 0;
     }
 
     char *prog = argv[1];
-    pid_t pid = fork();
+    char *args[] = {prog, nullptr};
+    pid_t pid = launch(args);
 
     if (pid == -1) {
         std::cerr << "Program failed to start" << std::endl;
         return -1;
     }
 
-    if (pid == 0) {
-        ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
-        return execl(prog, prog, nullptr);
-    }
-
     std::cout << "Started " << prog << " with PID " << pid << std::endl;
     debugger dbg{prog, pid};
     dbg.run();